@@ -8,13 +8,64 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <limits>
+#include <optional>
+#include <sstream>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
 #include <utility>
+#include <variant>
+#include <vector>
+
+#if __has_include(<sys/mman.h>) && __has_include(<unistd.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SETM_BMP_MMAP 1
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define SETM_BMP_IO_URING 1
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && __has_include(<immintrin.h>)
+#include <immintrin.h>
+#define SETM_BMP_AVX2 1
+#endif
+
+#if __has_include(<sys/resource.h>)
+#include <sys/resource.h>
+#endif
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 
 namespace fs = std::filesystem;
@@ -68,17 +119,545 @@ struct rgb_triple {
 namespace constants {
 
 static const auto assets_directory{ fs::current_path().append("assets") };
-static const auto target_bitcount{ 4 };
 static const auto input_bmp_file_path{ assets_directory / "input.bmp" };
 static const auto output_bmp_file_path{ assets_directory / "output_4bit.bmp" };
+// Path standing for stdin (as input) or stdout (as output).
+static const fs::path standard_stream{ "-" };
 // The header field used to identify the BMP and DIB file is 0x42 0x4D in hexadecimal, same as BM in ASCII:
 //   (https://en.wikipedia.org/wiki/BMP_file_format#Bitmap_file_header).
 // Bytes are in reverse order because of little endian architecture:
 //   (https://en.wikipedia.org/wiki/Endianness).
 static constexpr auto BMP_SIGNATURE{ 0x4D42 };
+// Largest number of pixel rows travelling through the pipeline as one unit of work.
+static constexpr std::size_t max_strip_rows{ 64 };
+// Largest accepted row of the 24-bit image, and largest strip buffer, so that one strip always fits a single read
+// or write request (Linux transfers at most 2 GiB at once).
+static constexpr std::size_t max_row_size{ 1 << 30 };
+// Default ceiling for the pixel buffers of a conversion, whatever the size of the image.
+static constexpr std::size_t memory_budget{ 64 << 20 };
+// Error diffusion publishes the progress of a row every this many pixels.
+static constexpr std::size_t progress_interval{ 16 };
+// Ordered dithering moves channels by up to half this much either way.
+static constexpr std::int32_t ordered_dither_spread{ 64 };
+// Largest accepted side of an ordered dithering threshold tile.
+static constexpr std::int32_t max_threshold_map_size{ 1024 };
+// Number of strips each converter worker may have in flight (bounds memory and applies backpressure).
+static constexpr std::size_t strips_per_worker{ 2 };
+// Batch mode converts files up to this size (and a sixth of the memory budget) whole, and submits the I/O of up to
+// this many files at once.
+static constexpr std::uintmax_t batch_file_limit{ 16 << 20 };
+static constexpr std::size_t batch_window{ 64 };
+// Palette sampling takes every this many pixels of a sampled row; palette errors are estimated on this percentage of the rows.
+static constexpr std::size_t sample_column_stride{ 4 };
+static constexpr double holdout_sample_percent{ 1.0 };
+// Images with at least this many pixels look their colors up in a table over all 24-bit colors, if it fits
+// half the memory budget.
+static constexpr std::uint64_t lookup_table_pixels{ 1 << 20 };
+// Bytes of such a table: an index and a presence bit per color (18 MiB).
+static constexpr std::size_t lookup_table_size{ (std::size_t{ 1 } << 24) + (std::size_t{ 1 } << 24) / 8 };
+
+// The Super Cassette Vision, equipped with an EPOCH TV-1 video processor, uses a 16-color palette.
+//   (https://en.wikipedia.org/wiki/List_of_video_game_console_palettes).
+constexpr std::array palette{
+    // Using BGRA color order.
+    rgb_quad{ 0x00, 0x00, 0x00, 0x00 },  // #000000 (Black).
+    rgb_quad{ 0x00, 0x00, 0xFF, 0x00 },  // #ff0000 (Red).
+    rgb_quad{ 0x00, 0xA1, 0xFF, 0x00 },  // #ffa100 (Orange).
+    rgb_quad{ 0x9F, 0xA0, 0xFF, 0x00 },  // #ffa09f (Light Red).
+    rgb_quad{ 0x00, 0xFF, 0xFF, 0x00 },  // #ffff00 (Yellow).
+    rgb_quad{ 0x00, 0xA0, 0xA3, 0x00 },  // #a3a000 (Dark Yellow).
+    rgb_quad{ 0x00, 0xA1, 0x00, 0x00 },  // #00a100 (Green).
+    rgb_quad{ 0x00, 0xFF, 0x00, 0x00 },  // #00ff00 (Lime).
+    rgb_quad{ 0x9D, 0xFF, 0xA0, 0x00 },  // #a0ff9d (Light Green).
+    rgb_quad{ 0x9B, 0x00, 0x00, 0x00 },  // #00009b (Dark Blue).
+    rgb_quad{ 0xFF, 0x00, 0x00, 0x00 },  // #0000ff (Blue).
+    rgb_quad{ 0xFF, 0x00, 0xA2, 0x00 },  // #a200ff (Purple).
+    rgb_quad{ 0xFF, 0x00, 0xFF, 0x00 },  // #ff00ff (Pink/Magenta).
+    rgb_quad{ 0xFF, 0xFF, 0x00, 0x00 },  // #00ffff (Cyan).
+    rgb_quad{ 0x9F, 0xA1, 0xA2, 0x00 },  // #a2a19f (Gray).
+    rgb_quad{ 0xFF, 0xFF, 0xFF, 0x00 },  // #ffffff (White).
+};
+// File header and info header of the 24-bit image.
+static constexpr std::size_t input_headers_size{ sizeof(bitmap_file_header) + sizeof(bitmap_info_header) };
+// Adaptive palettes have as many colors as the fixed one.
+static constexpr std::size_t adaptive_colors{ palette.size() };
 
 };  // namespace constants
 
+// Color table of the converted image: up to 256 colors, kept inline. The image takes the fewest bits per pixel
+// that address them all among those BMP readers support for indexed images (1, 4 or 8).
+class color_table {
+public:
+    static constexpr std::size_t capacity{ 256 };
+
+    constexpr color_table() noexcept = default;
+
+    // `size` black colors.
+    constexpr explicit color_table(std::size_t size) noexcept
+        : size_{ std::min(size, capacity) } {}
+
+    template<std::size_t N>
+        requires(N <= capacity)
+    constexpr color_table(const std::array<rgb_quad, N> &colors) noexcept
+        : size_{ N } {
+        std::ranges::copy(colors, colors_.begin());
+    }
+
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr rgb_quad *data() noexcept { return colors_.data(); }
+    constexpr const rgb_quad *data() const noexcept { return colors_.data(); }
+    constexpr rgb_quad *begin() noexcept { return colors_.data(); }
+    constexpr const rgb_quad *begin() const noexcept { return colors_.data(); }
+    constexpr rgb_quad *end() noexcept { return colors_.data() + size_; }
+    constexpr const rgb_quad *end() const noexcept { return colors_.data() + size_; }
+    constexpr rgb_quad &operator[](std::size_t index) noexcept { return colors_[index]; }
+    constexpr const rgb_quad &operator[](std::size_t index) const noexcept { return colors_[index]; }
+
+    constexpr std::uint16_t bit_count() const noexcept { return size_ <= 2 ? 1 : size_ <= 16 ? 4 : 8; }
+    // Entries of the color table in the image header: all those its bit depth addresses, unused ones black.
+    constexpr std::size_t header_entries() const noexcept { return std::size_t{ 1 } << bit_count(); }
+
+private:
+    std::array<rgb_quad, capacity> colors_{};
+    std::size_t size_{};
+};
+
+// Built-in palettes of consoles and computers, selected by name. The tables are built at compile time, and
+// their sizes checked there too; their nearest color tables are filled at run time by the palette matcher.
+//   (https://en.wikipedia.org/wiki/List_of_video_game_console_palettes).
+namespace palettes {
+
+// A color written as 0xRRGGBB.
+constexpr rgb_quad rgb(std::uint32_t value) noexcept {
+    return { static_cast<std::uint8_t>(value), static_cast<std::uint8_t>(value >> 8), static_cast<std::uint8_t>(value >> 16), 0 };
+}
+
+constexpr std::array monochrome{ rgb(0x000000), rgb(0xFFFFFF) };
+
+// CGA graphics mode 4, palette 1 at high intensity.
+constexpr std::array cga{ rgb(0x000000), rgb(0x55FFFF), rgb(0xFF55FF), rgb(0xFFFFFF) };
+
+// The 16 RGBI colors of CGA text modes, also the default EGA palette.
+constexpr std::array cga16{
+    rgb(0x000000), rgb(0x0000AA), rgb(0x00AA00), rgb(0x00AAAA), rgb(0xAA0000), rgb(0xAA00AA), rgb(0xAA5500), rgb(0xAAAAAA),
+    rgb(0x555555), rgb(0x5555FF), rgb(0x55FF55), rgb(0x55FFFF), rgb(0xFF5555), rgb(0xFF55FF), rgb(0xFFFF55), rgb(0xFFFFFF),
+};
+
+// All 64 colors of EGA: every channel has a primary (0xAA) and a secondary (0x55) bit.
+constexpr auto ega{ [] {
+    std::array<rgb_quad, 64> colors{};
+    for(std::uint32_t index{}; index < colors.size(); ++index) {
+        const auto level{ [index](std::uint32_t primary, std::uint32_t secondary) {
+            return static_cast<std::uint8_t>((index >> primary & 1) * 0xAA + (index >> secondary & 1) * 0x55);
+        } };
+        colors[index] = { level(0, 3), level(1, 4), level(2, 5), 0 };
+    }
+    return colors;
+}() };
+
+// Original Game Boy (DMG-01) shades of green.
+constexpr std::array game_boy{ rgb(0x0F380F), rgb(0x306230), rgb(0x8BAC0F), rgb(0x9BBC0F) };
+
+constexpr std::array nes{
+    rgb(0x7C7C7C), rgb(0x0000FC), rgb(0x0000BC), rgb(0x4428BC), rgb(0x940084), rgb(0xA80020), rgb(0xA81000), rgb(0x881400),
+    rgb(0x503000), rgb(0x007800), rgb(0x006800), rgb(0x005800), rgb(0x004058), rgb(0x000000), rgb(0x000000), rgb(0x000000),
+    rgb(0xBCBCBC), rgb(0x0078F8), rgb(0x0058F8), rgb(0x6844FC), rgb(0xD800CC), rgb(0xE40058), rgb(0xF83800), rgb(0xE45C10),
+    rgb(0xAC7C00), rgb(0x00B800), rgb(0x00A800), rgb(0x00A844), rgb(0x008888), rgb(0x000000), rgb(0x000000), rgb(0x000000),
+    rgb(0xF8F8F8), rgb(0x3CBCFC), rgb(0x6888FC), rgb(0x9878F8), rgb(0xF878F8), rgb(0xF85898), rgb(0xF87858), rgb(0xFCA044),
+    rgb(0xF8B800), rgb(0xB8F818), rgb(0x58D854), rgb(0x58F898), rgb(0x00E8D8), rgb(0x787878), rgb(0x000000), rgb(0x000000),
+    rgb(0xFCFCFC), rgb(0xA4E4FC), rgb(0xB8B8F8), rgb(0xD8B8F8), rgb(0xF8B8F8), rgb(0xF8A4C0), rgb(0xF0D0B0), rgb(0xFCE0A8),
+    rgb(0xF8D878), rgb(0xD8F878), rgb(0xB8F8B8), rgb(0xB8F8D8), rgb(0x00FCFC), rgb(0xF8D8F8), rgb(0x000000), rgb(0x000000),
+};
+
+// Commodore 64 (Pepto's measurements).
+constexpr std::array c64{
+    rgb(0x000000), rgb(0xFFFFFF), rgb(0x68372B), rgb(0x70A4B2), rgb(0x6F3D86), rgb(0x588D43), rgb(0x352879), rgb(0xB8C76F),
+    rgb(0x6F4F25), rgb(0x433900), rgb(0x9A6759), rgb(0x444444), rgb(0x6C6C6C), rgb(0x9AD284), rgb(0x6C5EB5), rgb(0x959595),
+};
+
+// PICO-8 fantasy console.
+constexpr std::array pico8{
+    rgb(0x000000), rgb(0x1D2B53), rgb(0x7E2553), rgb(0x008751), rgb(0xAB5236), rgb(0x5F574F), rgb(0xC2C3C7), rgb(0xFFF1E8),
+    rgb(0xFF004D), rgb(0xFFA300), rgb(0xFFEC27), rgb(0x00E436), rgb(0x29ADFF), rgb(0x83769C), rgb(0xFF77A8), rgb(0xFFCCAA),
+};
+
+// 3 bits of red and green, 2 bits of blue.
+constexpr auto rgb332{ [] {
+    std::array<rgb_quad, 256> colors{};
+    for(std::uint32_t index{}; index < colors.size(); ++index) {
+        colors[index] = { static_cast<std::uint8_t>((index & 3) * 85), static_cast<std::uint8_t>(((index >> 2) & 7) * 255 / 7),
+                          static_cast<std::uint8_t>((index >> 5) * 255 / 7), 0 };
+    }
+    return colors;
+}() };
+
+// The 256 colors of xterm: 16 system colors, a 6x6x6 cube and 24 grays.
+constexpr auto xterm256{ [] {
+    std::array<rgb_quad, 256> colors{};
+    constexpr std::array system{
+        rgb(0x000000), rgb(0x800000), rgb(0x008000), rgb(0x808000), rgb(0x000080), rgb(0x800080), rgb(0x008080), rgb(0xC0C0C0),
+        rgb(0x808080), rgb(0xFF0000), rgb(0x00FF00), rgb(0xFFFF00), rgb(0x0000FF), rgb(0xFF00FF), rgb(0x00FFFF), rgb(0xFFFFFF),
+    };
+    std::ranges::copy(system, colors.begin());
+    constexpr std::array<std::uint8_t, 6> levels{ 0, 95, 135, 175, 215, 255 };
+    for(std::size_t index{}; index < 216; ++index) {
+        colors[16 + index] = { levels[index % 6], levels[index / 6 % 6], levels[index / 36], 0 };
+    }
+    for(std::size_t index{}; index < 24; ++index) {
+        const auto gray{ static_cast<std::uint8_t>(8 + 10 * index) };
+        colors[232 + index] = { gray, gray, gray, 0 };
+    }
+    return colors;
+}() };
+
+struct entry {
+    std::string_view name;
+    color_table colors;
+};
+
+constexpr std::array registry{
+    entry{ "scv", constants::palette },  entry{ "mono", monochrome }, entry{ "cga", cga },
+    entry{ "cga16", cga16 },             entry{ "ega", ega },         entry{ "gameboy", game_boy },
+    entry{ "nes", nes },                 entry{ "c64", c64 },         entry{ "pico8", pico8 },
+    entry{ "rgb332", rgb332 },           entry{ "xterm256", xterm256 },
+};
+static_assert(std::ranges::all_of(registry, [](const entry &entry) {
+    return entry.colors.size() == 2 || entry.colors.size() == 4 || entry.colors.size() == 16 || entry.colors.size() == 64 ||
+           entry.colors.size() == 256;
+}));
+static_assert(registry[0].colors.bit_count() == 4 && ega[63].red == 0xFF && xterm256[231].blue == 0xFF);
+
+std::optional<color_table> find(std::string_view name) noexcept {
+    const auto found{ std::ranges::find(registry, name, &entry::name) };
+    return found != registry.end() ? std::optional{ found->colors } : std::nullopt;
+}
+
+// Reads "R G B" lines of a text palette, skipping those that do not start with a number (names, comments).
+inline bool read_text_colors(std::istream &file, std::size_t limit, color_table &palette) {
+    std::vector<rgb_quad> colors;
+    for(std::string line; colors.size() < limit && std::getline(file, line);) {
+        std::istringstream fields{ line };
+        int red{ -1 }, green{ -1 }, blue{ -1 };
+        if(!(fields >> red >> green >> blue)) {
+            continue;
+        }
+        if(std::min({ red, green, blue }) < 0 || std::max({ red, green, blue }) > 255 ||
+           colors.size() == color_table::capacity) {
+            return false;
+        }
+        colors.push_back({ static_cast<std::uint8_t>(blue), static_cast<std::uint8_t>(green), static_cast<std::uint8_t>(red), 0 });
+    }
+    palette = color_table{ colors.size() };
+    std::ranges::copy(colors, palette.begin());
+    return !colors.empty();
+}
+
+// Loads a palette file, told apart by its extension: JASC-PAL (.pal), GIMP (.gpl), Adobe Color Table (.act, 256
+// colors, with an optional count) or raw BGRA quads like a BMP color table (.bgra). Up to 256 colors.
+std::optional<color_table> load(const fs::path &palette_file_path) {
+    std::ifstream file{ palette_file_path, std::ios::binary };
+    if(!file) {
+        std::cerr << "Failed to open palette file " << palette_file_path << '\n';
+        return std::nullopt;
+    }
+    const auto extension{ palette_file_path.extension() };
+    color_table palette;
+    bool loaded{};
+    if(extension == ".pal" || extension == ".gpl") {
+        std::string signature, version;
+        std::getline(file, signature);
+        if(extension == ".pal" && signature.starts_with("JASC-PAL")) {
+            std::size_t count{};
+            file >> version >> count;
+            file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            loaded = file && read_text_colors(file, count, palette) && palette.size() == count;
+        } else if(extension == ".gpl" && signature.starts_with("GIMP Palette")) {
+            loaded = read_text_colors(file, color_table::capacity + 1, palette);
+        }
+    } else if(extension == ".act" || extension == ".bgra") {
+        const std::vector<std::uint8_t> bytes{ std::istreambuf_iterator<char>{ file }, {} };
+        if(extension == ".act" && (bytes.size() == 768 || bytes.size() == 772)) {
+            // The optional trailer holds the number of colors and a transparent index, big-endian.
+            const std::size_t count{ bytes.size() == 772 ? std::size_t{ bytes[768] } << 8 | bytes[769] : 256 };
+            loaded = count >= 1 && count <= 256;
+            palette = color_table{ count };
+            for(std::size_t index{}; loaded && index < count; ++index) {
+                palette[index] = { bytes[index * 3 + 2], bytes[index * 3 + 1], bytes[index * 3], 0 };
+            }
+        } else if(extension == ".bgra" && !bytes.empty() && bytes.size() % 4 == 0 && bytes.size() <= 4 * color_table::capacity) {
+            palette = color_table{ bytes.size() / 4 };
+            std::memcpy(palette.data(), bytes.data(), bytes.size());
+            std::ranges::for_each(palette, [](rgb_quad &color) { color.reserved = 0; });
+            loaded = true;
+        }
+    }
+    if(!loaded) {
+        std::cerr << "File " << palette_file_path << " is not a palette of 1 to 256 colors (.pal, .gpl, .act or .bgra)\n";
+        return std::nullopt;
+    }
+    return palette;
+}
+
+}  // namespace palettes
+
+namespace color {
+
+// Distance used to pick the palette color of a pixel.
+enum class metric {
+    rgb,      // Euclidean in sRGB.
+    redmean,  // Euclidean in sRGB, weighted by the mean red of the two colors.
+    luma,     // Euclidean in sRGB, weighted by the luma coefficients.
+    oklab,    // Euclidean in OKLab.
+    cie76,    // Euclidean in CIELAB.
+    cie94,    // CIE94 (graphic arts) in CIELAB, a cheap stand-in for CIEDE2000.
+    linear,   // Euclidean in linear light.
+};
+
+struct lab {
+    float l;
+    float a;
+    float b;
+};
+
+// Contributions of every 8-bit sRGB channel value to the three components of a linear transform of the color
+// (LMS cone responses for OKLab, XYZ for CIELAB). The sRGB decoding and the matrix product then reduce to
+// three table reads and additions per component.
+struct channel_tables {
+    std::array<std::array<float, 3>, 256> blue;
+    std::array<std::array<float, 3>, 256> green;
+    std::array<std::array<float, 3>, 256> red;
+
+    // Rows of the matrix applied to linear (red, green, blue).
+    explicit channel_tables(const std::array<std::array<float, 3>, 3> &matrix) {
+        for(std::size_t value{}; value < 256; ++value) {
+            const auto encoded{ static_cast<double>(value) / 255 };
+            const auto linear{ static_cast<float>(encoded <= 0.04045 ? encoded / 12.92
+                                                                     : std::pow((encoded + 0.055) / 1.055, 2.4)) };
+            for(std::size_t row{}; row < 3; ++row) {
+                red[value][row] = matrix[row][0] * linear;
+                green[value][row] = matrix[row][1] * linear;
+                blue[value][row] = matrix[row][2] * linear;
+            }
+        }
+    }
+
+    std::array<float, 3> transform(const rgb_triple &color) const noexcept {
+        const auto &b{ blue[color.blue] };
+        const auto &g{ green[color.green] };
+        const auto &r{ red[color.red] };
+        return { r[0] + g[0] + b[0], r[1] + g[1] + b[1], r[2] + g[2] + b[2] };
+    }
+};
+
+inline lab to_oklab(const rgb_triple &color) noexcept {
+    static const channel_tables tables{ { { { 0.4122214708F, 0.5363325363F, 0.0514459929F },
+                                            { 0.2119034982F, 0.6806995451F, 0.1073969566F },
+                                            { 0.0883024619F, 0.2817188376F, 0.6299787005F } } } };
+    const auto lms{ tables.transform(color) };
+    const auto l{ std::cbrt(lms[0]) };
+    const auto m{ std::cbrt(lms[1]) };
+    const auto s{ std::cbrt(lms[2]) };
+    return { 0.2104542553F * l + 0.7936177850F * m - 0.0040720468F * s,
+             1.9779984951F * l - 2.4285922050F * m + 0.4505937099F * s,
+             0.0259040371F * l + 0.7827717662F * m - 0.8086757660F * s };
+}
+
+inline lab to_cielab(const rgb_triple &color) noexcept {
+    // sRGB to XYZ, with every row divided by the D65 white point component so that white maps to (1, 1, 1).
+    static const channel_tables tables{ { { { 0.4124564F / 0.95047F, 0.3575761F / 0.95047F, 0.1804375F / 0.95047F },
+                                            { 0.2126729F, 0.7151522F, 0.0721750F },
+                                            { 0.0193339F / 1.08883F, 0.1191920F / 1.08883F, 0.9503041F / 1.08883F } } } };
+    const auto f{ [](float t) {
+        constexpr auto delta{ 6.0F / 29 };
+        return t > delta * delta * delta ? std::cbrt(t) : t / (3 * delta * delta) + 4.0F / 29;
+    } };
+    const auto xyz{ tables.transform(color) };
+    const auto fx{ f(xyz[0]) };
+    const auto fy{ f(xyz[1]) };
+    const auto fz{ f(xyz[2]) };
+    return { 116 * fy - 16, 500 * (fx - fy), 200 * (fy - fz) };
+}
+
+// Levels that dithering adds errors and thresholds in: the 8-bit sRGB values themselves, or 12-bit linear light.
+// Both directions are tables, so that working in linear light stays integral: 256 entries to decode, and one
+// per level to encode back to the nearest 8-bit sRGB value.
+struct transfer {
+    std::array<std::int32_t, 256> decode;
+    std::vector<std::uint8_t> encode;
+    std::int32_t max_level;
+
+    static const transfer &srgb() {
+        static const auto identity{ [] {
+            transfer transfer{ {}, std::vector<std::uint8_t>(256), 255 };
+            for(std::size_t value{}; value < 256; ++value) {
+                transfer.decode[value] = static_cast<std::int32_t>(value);
+                transfer.encode[value] = static_cast<std::uint8_t>(value);
+            }
+            return transfer;
+        }() };
+        return identity;
+    }
+
+    static const transfer &linear() {
+        static const auto linear{ [] {
+            constexpr std::int32_t max_level{ 4095 };
+            transfer transfer{ {}, std::vector<std::uint8_t>(max_level + 1), max_level };
+            for(std::size_t value{}; value < 256; ++value) {
+                const auto encoded{ static_cast<double>(value) / 255 };
+                const auto light{ encoded <= 0.04045 ? encoded / 12.92 : std::pow((encoded + 0.055) / 1.055, 2.4) };
+                transfer.decode[value] = static_cast<std::int32_t>(std::lround(light * max_level));
+            }
+            for(std::int32_t level{}; level <= max_level; ++level) {
+                const auto light{ static_cast<double>(level) / max_level };
+                const auto encoded{ light <= 0.0031308 ? light * 12.92 : 1.055 * std::pow(light, 1 / 2.4) - 0.055 };
+                transfer.encode[level] = static_cast<std::uint8_t>(std::lround(encoded * 255));
+            }
+            return transfer;
+        }() };
+        return linear;
+    }
+
+    std::uint8_t encode_level(std::int32_t level) const noexcept {
+        return encode[static_cast<std::size_t>(std::clamp(level, 0, max_level))];
+    }
+};
+
+// Metric policies. Each maps a color to a point of its space once, and measures a distance between a pixel's
+// point and a palette color's point that orders colors as the metric does (squared distances, mostly).
+// Searches are templates on the policy, so every metric gets its own inlined loop. Policies whose distance is a
+// weighted sum of squared channel differences, over points that grow with every channel, give the weights: lookup
+// tables then bound distances over whole boxes of colors.
+struct squared_rgb {
+    using point = std::array<std::int32_t, 3>;
+    static constexpr point weights{ 1, 1, 1 };
+
+    static point to_point(const rgb_triple &color) noexcept { return { color.blue, color.green, color.red }; }
+
+    static std::int32_t distance(const point &pixel, const point &target) noexcept {
+        const auto db{ pixel[0] - target[0] };
+        const auto dg{ pixel[1] - target[1] };
+        const auto dr{ pixel[2] - target[2] };
+        return db * db + dg * dg + dr * dr;
+    }
+};
+
+// The "redmean" approximation of perceived distance, in integers.
+struct redmean {
+    using point = std::array<std::int32_t, 3>;
+
+    static point to_point(const rgb_triple &color) noexcept { return { color.blue, color.green, color.red }; }
+
+    static std::int32_t distance(const point &pixel, const point &target) noexcept {
+        const auto mean_red{ (pixel[2] + target[2]) / 2 };
+        const auto db{ pixel[0] - target[0] };
+        const auto dg{ pixel[1] - target[1] };
+        const auto dr{ pixel[2] - target[2] };
+        return (((512 + mean_red) * dr * dr) >> 8) + 4 * dg * dg + (((767 - mean_red) * db * db) >> 8);
+    }
+};
+
+// Channel differences weighted by the Rec. 601 luma coefficients (in thousandths).
+struct luma_weighted {
+    using point = std::array<std::int32_t, 3>;
+    static constexpr point weights{ 114, 587, 299 };
+
+    static point to_point(const rgb_triple &color) noexcept { return { color.blue, color.green, color.red }; }
+
+    static std::int32_t distance(const point &pixel, const point &target) noexcept {
+        const auto db{ pixel[0] - target[0] };
+        const auto dg{ pixel[1] - target[1] };
+        const auto dr{ pixel[2] - target[2] };
+        return 114 * db * db + 587 * dg * dg + 299 * dr * dr;
+    }
+};
+
+struct oklab {
+    using point = lab;
+    // Squared Euclidean distance in the space of the points.
+    static constexpr bool euclidean{ true };
+
+    static point to_point(const rgb_triple &color) noexcept { return to_oklab(color); }
+
+    static float distance(const point &pixel, const point &target) noexcept {
+        const auto dl{ pixel.l - target.l };
+        const auto da{ pixel.a - target.a };
+        const auto db{ pixel.b - target.b };
+        return dl * dl + da * da + db * db;
+    }
+};
+
+struct cie76 {
+    using point = lab;
+    static constexpr bool euclidean{ true };
+
+    static point to_point(const rgb_triple &color) noexcept { return to_cielab(color); }
+
+    static float distance(const point &pixel, const point &target) noexcept { return oklab::distance(pixel, target); }
+};
+
+struct cie94 {
+    struct point {
+        lab coordinates;
+        float chroma;
+    };
+
+    static point to_point(const rgb_triple &color) noexcept {
+        const auto coordinates{ to_cielab(color) };
+        return { coordinates, std::hypot(coordinates.a, coordinates.b) };
+    }
+
+    // The pixel is the reference color: chroma and hue differences are weighted by its chroma.
+    static float distance(const point &pixel, const point &target) noexcept {
+        const auto dl{ pixel.coordinates.l - target.coordinates.l };
+        const auto da{ pixel.coordinates.a - target.coordinates.a };
+        const auto db{ pixel.coordinates.b - target.coordinates.b };
+        const auto dc{ pixel.chroma - target.chroma };
+        const auto dh_squared{ std::max(da * da + db * db - dc * dc, 0.0F) };
+        const auto sc{ 1 + 0.045F * pixel.chroma };
+        const auto sh{ 1 + 0.015F * pixel.chroma };
+        return dl * dl + dc * dc / (sc * sc) + dh_squared / (sh * sh);
+    }
+};
+
+// Squared distance between 12-bit linear-light colors.
+struct linear_rgb {
+    using point = std::array<std::int32_t, 3>;
+    static constexpr point weights{ 1, 1, 1 };
+
+    static point to_point(const rgb_triple &color) noexcept {
+        const auto &decode{ transfer::linear().decode };
+        return { decode[color.blue], decode[color.green], decode[color.red] };
+    }
+
+    static std::int32_t distance(const point &pixel, const point &target) noexcept {
+        return squared_rgb::distance(pixel, target);
+    }
+};
+
+// Calls `function` with the policy of a runtime metric, so that everything below the call is compiled per metric.
+template<typename Function>
+decltype(auto) with_metric(metric metric, Function &&function) {
+    switch(metric) {
+    case metric::redmean:
+        return function(redmean{});
+    case metric::luma:
+        return function(luma_weighted{});
+    case metric::oklab:
+        return function(oklab{});
+    case metric::cie76:
+        return function(cie76{});
+    case metric::cie94:
+        return function(cie94{});
+    case metric::linear:
+        return function(linear_rgb{});
+    case metric::rgb:
+        break;
+    }
+    return function(squared_rgb{});
+}
+
+}  // namespace color
+
 namespace utils {
 
 constexpr double color_distance(const rgb_triple &color1, const rgb_quad &color2) noexcept {
@@ -87,104 +666,4715 @@ constexpr double color_distance(const rgb_triple &color1, const rgb_quad &color2
                      std::pow((color2.red - color1.red), 2));
 }
 
-template<std::size_t N>
-constexpr std::byte find_closest_color(const rgb_triple &color, const std::array<rgb_quad, N> &palette) noexcept {
-    const auto distance_to_color{ [&color](const auto &lhs, const auto &rhs) {
-        return color_distance(color, lhs) < color_distance(color, rhs);
+// Index of the palette color closest to `color` under a metric policy, Euclidean in sRGB by default.
+template<typename Metric = color::squared_rgb>
+constexpr std::byte find_closest_color(const rgb_triple &color, const color_table &palette) noexcept {
+    const auto pixel{ Metric::to_point(color) };
+    const auto distance_to_color{ [&pixel](const rgb_quad &entry) {
+        return Metric::distance(pixel, Metric::to_point({ entry.blue, entry.green, entry.red }));
     } };
     return static_cast<std::byte>(
-        std::distance(std::begin(palette), std::ranges::min_element(palette, distance_to_color)));
+        std::distance(std::begin(palette), std::ranges::min_element(palette, {}, distance_to_color)));
+}
+
+// 64-bit hash of bytes, a word at a time with a final avalanche. Fit for cache keys and checksums against
+// corruption, not against tampering.
+inline std::uint64_t hash(std::span<const std::byte> bytes, std::uint64_t seed = 0) noexcept {
+    auto hash{ seed ^ (bytes.size() * 0x9E3779B97F4A7C15) };
+    const auto mix{ [&hash](std::uint64_t word) { hash = std::rotl(hash ^ word * 0x87C37B91114253D5, 31) * 0x4CF5AD432745937F; } };
+    std::size_t index{};
+    for(; index + 8 <= bytes.size(); index += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes.data() + index, sizeof(word));
+        mix(word);
+    }
+    for(; index < bytes.size(); ++index) {
+        mix(std::to_integer<std::uint64_t>(bytes[index]));
+    }
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EB;
+    return hash ^ (hash >> 31);
+}
+
+template<typename T>
+std::optional<T> parse_number(std::string_view text) noexcept {
+    T value{};
+    const auto [end, error]{ std::from_chars(text.data(), text.data() + text.size(), value) };
+    if(error != std::errc{} || end != text.data() + text.size()) {
+        return std::nullopt;
+    }
+    return value;
 }
 
 }  // namespace utils
 
-// Convert a 24-bit BMP image to a 4-bit.
-void convert_bmp_24_to_4_depth(const fs::path &input_file_path,
-                               const fs::path &output_file_path) {
-    // Open input BMP file.
-    std::ifstream input_file{ input_file_path, std::ios::binary };
-    if(!input_file) {
-        std::cerr << "Failed to open input file" << input_file_path << '\n';
-        return;
+// Geometry of a conversion, derived from the headers of the input image.
+struct bitmap_layout {
+    // Headers of the converted image.
+    bitmap_file_header file_header;
+    bitmap_info_header info_header;
+
+    std::size_t width;
+    std::size_t height;
+    // Each row is padded to a multiple of 4 bytes in both images.
+    std::size_t input_row_size;
+    std::size_t output_row_size;
+    std::uint64_t input_pixel_offset;
+    // Colors of the converted image: the fixed palette, or one derived from the image.
+    color_table palette{ constants::palette };
+
+    constexpr std::uint64_t output_size() const noexcept {
+        return file_header.bf_off_bits + std::uint64_t{ output_row_size } * height;
     }
+};
 
-    // Read BMP headers.
-    bitmap_file_header bmp_file_header;
-    input_file.read(reinterpret_cast<char *>(&bmp_file_header), sizeof(bitmap_file_header));
-    bitmap_info_header bmp_info_header;
-    input_file.read(reinterpret_cast<char *>(&bmp_info_header), sizeof(bitmap_info_header));
+// Give a layout its palette: the bit depth, row size and headers of the converted image follow from it.
+bool set_palette(bitmap_layout &layout, const color_table &palette, const fs::path &input_file_path) {
+    layout.output_row_size = (layout.width * palette.bit_count() + 31) / 32 * 4;
+    layout.palette = palette;
+    // BMP sizes are 32-bit; the input itself may come close to 4 GiB, the converted image is always smaller.
+    const auto headers_size{ constants::input_headers_size + palette.header_entries() * sizeof(rgb_quad) };
+    if(std::uint64_t{ layout.output_row_size } * layout.height > UINT32_MAX - headers_size ||
+       layout.input_row_size > constants::max_row_size) {
+        std::cerr << "File " << input_file_path << " is too large\n";
+        return false;
+    }
+    const auto pixel_array_size{ static_cast<std::uint32_t>(layout.output_row_size * layout.height) };
+    layout.file_header.bf_off_bits = static_cast<std::uint32_t>(headers_size);
+    layout.file_header.bf_size = layout.file_header.bf_off_bits + pixel_array_size;
+    layout.info_header.bi_size = sizeof(bitmap_info_header);
+    layout.info_header.bi_bit_count = palette.bit_count();
+    layout.info_header.bi_size_image = pixel_array_size;
+    layout.info_header.bi_clr_used = static_cast<std::uint32_t>(palette.header_entries());
+    layout.info_header.bi_clr_important = 0;
+    return true;
+}
 
+// Check the input headers and derive the layout of the image converted to a palette.
+std::optional<bitmap_layout> make_layout(bitmap_file_header bmp_file_header, bitmap_info_header bmp_info_header,
+                                         const fs::path &input_file_path, const color_table &palette) {
     // Check if the file is a BMP file.
     if(bmp_file_header.bf_type != constants::BMP_SIGNATURE) {
         std::cerr << "File " << input_file_path << " is not a BMP file\n";
-        return;
+        return std::nullopt;
     }
 
     // Check if the number of bits per pixel is 24.
     if(bmp_info_header.bi_bit_count != 24) {
         std::cerr << "File " << input_file_path << " has not 24 bits per pixel\n";
-        return;
+        return std::nullopt;
     }
 
-    // Open output BMP file.
-    std::ofstream output_file{ output_file_path, std::ios::binary };
-    if(!output_file) {
-        std::cerr << "Failed to open output file " << output_file_path << '\n';
-        return;
-    }
-
-    // The Super Cassette Vision, equipped with an EPOCH TV-1 video processor, uses a 16-color palette.
-    //   (https://en.wikipedia.org/wiki/List_of_video_game_console_palettes).
-    constexpr static std::array palette{
-        // Using BGRA color order.
-        rgb_quad{ 0x00, 0x00, 0x00, 0x00 },  // #000000 (Black).
-        rgb_quad{ 0x00, 0x00, 0xFF, 0x00 },  // #ff0000 (Red).
-        rgb_quad{ 0x00, 0xA1, 0xFF, 0x00 },  // #ffa100 (Orange).
-        rgb_quad{ 0x9F, 0xA0, 0xFF, 0x00 },  // #ffa09f (Light Red).
-        rgb_quad{ 0x00, 0xFF, 0xFF, 0x00 },  // #ffff00 (Yellow).
-        rgb_quad{ 0x00, 0xA0, 0xA3, 0x00 },  // #a3a000 (Dark Yellow).
-        rgb_quad{ 0x00, 0xA1, 0x00, 0x00 },  // #00a100 (Green).
-        rgb_quad{ 0x00, 0xFF, 0x00, 0x00 },  // #00ff00 (Lime).
-        rgb_quad{ 0x9D, 0xFF, 0xA0, 0x00 },  // #a0ff9d (Light Green).
-        rgb_quad{ 0x9B, 0x00, 0x00, 0x00 },  // #00009b (Dark Blue).
-        rgb_quad{ 0xFF, 0x00, 0x00, 0x00 },  // #0000ff (Blue).
-        rgb_quad{ 0xFF, 0x00, 0xA2, 0x00 },  // #a200ff (Purple).
-        rgb_quad{ 0xFF, 0x00, 0xFF, 0x00 },  // #ff00ff (Pink/Magenta).
-        rgb_quad{ 0xFF, 0xFF, 0x00, 0x00 },  // #00ffff (Cyan).
-        rgb_quad{ 0x9F, 0xA1, 0xA2, 0x00 },  // #a2a19f (Gray).
-        rgb_quad{ 0xFF, 0xFF, 0xFF, 0x00 },  // #ffffff (White).
-    };
+    // Only uncompressed (BI_RGB) pixel data can be converted.
+    if(bmp_info_header.bi_compression != 0 || bmp_info_header.bi_width <= 0 ||
+       bmp_file_header.bf_off_bits < constants::input_headers_size) {
+        std::cerr << "File " << input_file_path << " is compressed or malformed\n";
+        return std::nullopt;
+    }
 
-    // Update file headers for 4-bit depth.
-    const auto row_size{
-        static_cast<std::uint32_t>(std::ceil(constants::target_bitcount * bmp_info_header.bi_width / 32) * 4)
-    };
-    const auto pixel_array_size{ row_size * bmp_info_header.bi_height };
-    bmp_file_header.bf_size = pixel_array_size + sizeof(bitmap_file_header) + sizeof(bitmap_info_header);
-    bmp_file_header.bf_off_bits += sizeof(rgb_quad) * std::pow(2, constants::target_bitcount);
-    bmp_info_header.bi_bit_count = constants::target_bitcount;
-    output_file.write(reinterpret_cast<char *>(&bmp_file_header), sizeof(bitmap_file_header));
-    output_file.write(reinterpret_cast<char *>(&bmp_info_header), sizeof(bitmap_info_header));
-    output_file.write(reinterpret_cast<const char *>(palette.data()), sizeof(palette));
-
-    for(std::size_t row{}; row < bmp_info_header.bi_height; ++row) {
-        for(std::size_t column{}; column < bmp_info_header.bi_width; column += 2) {
-            std::pair<rgb_triple, rgb_triple> pixels;
-            input_file.read(reinterpret_cast<char *>(&pixels), sizeof(pixels));
-            const std::byte two_pixels{
-                (utils::find_closest_color(pixels.first, palette) << 4) |
-                (utils::find_closest_color(pixels.second, palette))
-            };
-            output_file.write(reinterpret_cast<const char *>(&two_pixels), sizeof(two_pixels));
+    // The headers of the converted image start as copies of the input ones.
+    bitmap_layout layout{};
+    layout.width = static_cast<std::size_t>(bmp_info_header.bi_width);
+    layout.height = static_cast<std::size_t>(std::abs(bmp_info_header.bi_height));
+    layout.input_row_size = (layout.width * 24 + 31) / 32 * 4;
+    layout.input_pixel_offset = bmp_file_header.bf_off_bits;
+    layout.file_header = bmp_file_header;
+    layout.info_header = bmp_info_header;
+    if(!set_palette(layout, palette, input_file_path)) {
+        return std::nullopt;
+    }
+    return layout;
+}
+
+// Serialize the headers and the color table of the converted image.
+std::vector<std::byte> make_output_headers(const bitmap_layout &layout) {
+    std::vector<std::byte> headers(layout.file_header.bf_off_bits);
+    auto *position{ headers.data() };
+    position = std::copy_n(reinterpret_cast<const std::byte *>(&layout.file_header), sizeof(bitmap_file_header), position);
+    position = std::copy_n(reinterpret_cast<const std::byte *>(&layout.info_header), sizeof(bitmap_info_header), position);
+    std::copy_n(reinterpret_cast<const std::byte *>(layout.palette.data()), layout.palette.size() * sizeof(rgb_quad), position);
+    return headers;
+}
+
+// Stores palette indices of `count` pixels from `first_column` on in a row of the converted image, most significant
+// bits first. The row must be zeroed.
+template<std::size_t Bits>
+void pack_indices(const std::byte *indices, std::size_t count, std::size_t first_column, std::byte *row) noexcept {
+    constexpr std::size_t per_byte{ 8 / Bits };
+    for(std::size_t index{}; index < count; ++index) {
+        const auto column{ first_column + index };
+        row[column / per_byte] |= indices[index] << ((per_byte - 1 - column % per_byte) * Bits);
+    }
+}
+
+// Palette index of a pixel of a packed row.
+template<std::size_t Bits>
+std::byte packed_index(const std::byte *row, std::size_t column) noexcept {
+    constexpr std::size_t per_byte{ 8 / Bits };
+    return (row[column / per_byte] >> ((per_byte - 1 - column % per_byte) * Bits)) & std::byte{ (1U << Bits) - 1 };
+}
+
+// Loads palette indices of `count` pixels from `first_column` on from a packed row: pixels before the first whole
+// byte one at a time, then all the pixels of every whole byte at once.
+template<std::size_t Bits>
+void unpack_indices(const std::byte *row, std::size_t first_column, std::size_t count, std::byte *indices) noexcept {
+    constexpr std::size_t per_byte{ 8 / Bits };
+    std::size_t index{};
+    for(; index < count && (first_column + index) % per_byte != 0; ++index) {
+        indices[index] = packed_index<Bits>(row, first_column + index);
+    }
+    for(; index + per_byte <= count; index += per_byte) {
+        const auto byte{ row[(first_column + index) / per_byte] };
+        for(std::size_t pixel{}; pixel < per_byte; ++pixel) {
+            indices[index + pixel] = (byte >> ((per_byte - 1 - pixel) * Bits)) & std::byte{ (1U << Bits) - 1 };
         }
     }
+    for(; index < count; ++index) {
+        indices[index] = packed_index<Bits>(row, first_column + index);
+    }
 }
 
-}  // namespace setm::bmp
+inline void pack_indices(const std::byte *indices, std::size_t count, std::size_t first_column, std::byte *row,
+                         const bitmap_layout &layout) noexcept {
+    switch(layout.info_header.bi_bit_count) {
+    case 1:
+        return pack_indices<1>(indices, count, first_column, row);
+    case 8:
+        return pack_indices<8>(indices, count, first_column, row);
+    default:
+        return pack_indices<4>(indices, count, first_column, row);
+    }
+}
 
-int main() {
-    using namespace setm::bmp;
+namespace color {
+
+// Nearest-color table over all 2^24 colors of a palette and metric. A table filled as colors are first met has a
+// presence bitmap; a complete one is built up front or mapped from elsewhere (then `owner` keeps it alive).
+struct lookup_table {
+    explicit lookup_table(bool lazy) {
+        if(lazy) {
+            entries = std::make_unique_for_overwrite<std::uint8_t[]>(std::size_t{ 1 } << 24);
+            present = std::make_unique<std::uint64_t[]>((std::size_t{ 1 } << 24) / 64);
+        }
+    }
+
+    std::unique_ptr<std::uint8_t[]> entries;
+    std::unique_ptr<std::uint64_t[]> present;
+    const std::uint8_t *complete{};
+    std::shared_ptr<const void> owner;
+    // Held while the table is built or adopted, so that converters sharing it do that once.
+    std::mutex preparing;
+};
+
+// Lookup tables of the converters of a conversion (or of a batch), charged to its memory budget. Converters with
+// the same palette and metric share a table, and tables are handed out while those alive fit in half the budget;
+// the strips get the rest. A table is released with its last converter.
+class lookup_tables {
+public:
+    explicit lookup_tables(std::size_t memory_budget) noexcept
+        : memory_budget_{ memory_budget } {}
+
+    // The table of a palette and metric, or nothing when another one does not fit the budget.
+    std::shared_ptr<lookup_table> acquire(const color_table &palette, metric metric, bool lazy) {
+        std::string key(reinterpret_cast<const char *>(palette.begin()), palette.size() * sizeof(rgb_quad));
+        key += static_cast<char>(metric);
+        const std::scoped_lock lock{ mutex_ };
+        std::erase_if(tables_, [](const auto &entry) { return entry.second.expired(); });
+        for(const auto &[stored_key, table] : tables_) {
+            if(stored_key == key) {
+                return table.lock();
+            }
+        }
+        if((tables_.size() + 1) * constants::lookup_table_size > memory_budget_ / 2) {
+            return nullptr;
+        }
+        auto table{ std::make_shared<lookup_table>(lazy) };
+        tables_.emplace_back(std::move(key), table);
+        return table;
+    }
+
+    std::size_t budget() const noexcept { return memory_budget_; }
+
+    // Budget left for the strips by the tables alive.
+    std::size_t strip_budget() {
+        const std::scoped_lock lock{ mutex_ };
+        const auto alive{ static_cast<std::size_t>(std::ranges::count_if(tables_, [](const auto &entry) {
+            return !entry.second.expired();
+        })) };
+        return memory_budget_ - std::min(memory_budget_, alive * constants::lookup_table_size);
+    }
+
+private:
+    std::size_t memory_budget_;
+    std::mutex mutex_;
+    std::vector<std::pair<std::string, std::weak_ptr<lookup_table>>> tables_;
+};
+
+// Finds the palette color closest to a pixel under a metric policy. The palette is converted to the policy's
+// space once, at construction. Large images add a lookup table over all 2^24 colors, filled as colors are first
+// met: a presence bitmap tells which entries are set, so every distinct color is searched once whatever the
+// number of its pixels. Entries are written and published with atomics, so that converter threads, and the
+// converters sharing the table, fill it together.
+template<typename Metric>
+class palette_matcher {
+public:
+    palette_matcher(const color_table &palette, std::shared_ptr<lookup_table> table)
+        : table_{ std::move(table) } {
+        for(std::size_t index{}; index < palette.size(); ++index) {
+            points_[index] = Metric::to_point({ palette[index].blue, palette[index].green, palette[index].red });
+        }
+        size_ = std::max<std::size_t>(palette.size(), 1);
+        if(table_) {
+            entries_ = table_->entries.get();
+            present_ = table_->present.get();
+            complete_ = table_->complete;
+        }
+    }
+
+    std::byte closest(const rgb_triple &color) const noexcept {
+        const auto key{ std::uint32_t{ color.red } << 16 | std::uint32_t{ color.green } << 8 | color.blue };
+        if(complete_) {
+            return static_cast<std::byte>(complete_[key]);
+        }
+        if(!present_) {
+            return search(color);
+        }
+        const auto bit{ std::uint64_t{ 1 } << (key % 64) };
+        std::atomic_ref<std::uint64_t> word{ present_[key / 64] };
+        std::atomic_ref<std::uint8_t> entry{ entries_[key] };
+        if((word.load(std::memory_order_acquire) & bit) != 0) {
+            return static_cast<std::byte>(entry.load(std::memory_order_relaxed));
+        }
+        const auto index{ search(color) };
+        entry.store(std::to_integer<std::uint8_t>(index), std::memory_order_relaxed);
+        word.fetch_or(bit, std::memory_order_release);
+        return index;
+    }
+
+    // Batched variant: the palette indices of `count` pixels.
+    void closest(const rgb_triple *pixels, std::size_t count, std::byte *indices) const noexcept {
+        for(std::size_t index{}; index < count; ++index) {
+            indices[index] = closest(pixels[index]);
+        }
+    }
+
+    // Whether the matcher has a lookup table to fill or use.
+    bool has_table() const noexcept { return table_ != nullptr; }
+
+    // Fills the whole lookup table up front on `threads` threads, instead of color by color as they are met.
+    // The color cube is cut into cells of 8x8x8 colors. A palette color only stays a candidate for a cell if its
+    // nearest possible distance to the cell is within the farthest distance of the best other candidate, i.e. if
+    // its Voronoi region may reach the cell; usually a few of them are left. Metrics with weights bound distances
+    // over the box of the cell, Euclidean ones by the triangle inequality around the mean point of the cell, and
+    // the others keep all candidates. Each candidate is then measured against the 512 colors of the cell at once,
+    // in a branchless loop (over channel arrays for metrics with weights) that compilers vectorize. Candidates are
+    // tried in palette order and only strictly closer ones win, so the table holds what the search itself gives.
+    // A table that another converter sharing it has completed is used as is. Returns whether it was built here.
+    bool build(std::size_t threads) {
+        const std::scoped_lock lock{ table_->preparing };
+        if(table_->complete) {
+            complete_ = table_->complete;
+            return false;
+        }
+        if(!table_->entries) {
+            table_->entries = std::make_unique_for_overwrite<std::uint8_t[]>(std::size_t{ 1 } << 24);
+        }
+        entries_ = table_->entries.get();
+        std::atomic<std::size_t> next{};
+        const auto work{ [&] {
+            for(std::size_t cell; (cell = next.fetch_add(1, std::memory_order_relaxed)) < cells;) {
+                build_cell(cell);
+            }
+        } };
+        {
+            std::vector<std::jthread> team(std::max<std::size_t>(threads, 1) - 1);
+            for(auto &member : team) {
+                member = std::jthread{ work };
+            }
+            work();
+        }
+        table_->complete = complete_ = entries_;
+        return true;
+    }
+
+    // Uses a complete table from elsewhere (a mapped cache file, say), which `owner` keeps alive, unless another
+    // converter sharing the table has completed it already.
+    void adopt(const std::uint8_t *table, std::shared_ptr<const void> owner) {
+        const std::scoped_lock lock{ table_->preparing };
+        if(!table_->complete) {
+            table_->complete = table;
+            table_->owner = std::move(owner);
+        }
+        complete_ = table_->complete;
+    }
+
+    // The complete table, once built or adopted.
+    const std::uint8_t *table() const noexcept { return complete_; }
+
+private:
+    static constexpr std::size_t cell_side{ 8 };
+    static constexpr std::size_t cell_colors{ cell_side * cell_side * cell_side };
+    static constexpr std::size_t cells{ (std::size_t{ 1 } << 24) / cell_colors };
+
+    // Cells are numbered red, green, blue from the most significant bits, colors within a cell likewise.
+    static rgb_triple cell_color(std::size_t cell, std::size_t color) noexcept {
+        const auto channel{ [&](std::size_t shift) {
+            return static_cast<std::uint8_t>((cell >> shift) % 32 * cell_side + (color >> (shift / 5 * 3)) % cell_side);
+        } };
+        return { channel(0), channel(5), channel(10) };
+    }
+
+    void build_cell(std::size_t cell) noexcept {
+        std::array<std::uint8_t, color_table::capacity> candidates;
+        std::size_t count{};
+        if constexpr(requires { Metric::weights; }) {
+            const auto low{ Metric::to_point(cell_color(cell, 0)) };
+            const auto high{ Metric::to_point(cell_color(cell, cell_colors - 1)) };
+            std::array<std::int64_t, color_table::capacity> nearest;
+            auto bound{ std::numeric_limits<std::int64_t>::max() };
+            for(std::size_t index{}; index < size_; ++index) {
+                std::int64_t near{}, far{};
+                for(std::size_t channel{}; channel < 3; ++channel) {
+                    const std::int64_t target{ points_[index][channel] };
+                    const auto inside{ std::clamp<std::int64_t>(target, low[channel], high[channel]) };
+                    const auto farthest{ std::max(target - low[channel], high[channel] - target) };
+                    near += Metric::weights[channel] * (target - inside) * (target - inside);
+                    far += Metric::weights[channel] * farthest * farthest;
+                }
+                nearest[index] = near;
+                bound = std::min(bound, far);
+            }
+            for(std::size_t index{}; index < size_; ++index) {
+                if(nearest[index] <= bound) {
+                    candidates[count++] = static_cast<std::uint8_t>(index);
+                }
+            }
+        }
+
+        std::array<std::uint8_t, cell_colors> best;
+        if constexpr(requires { Metric::weights; }) {
+            std::array<std::array<std::int32_t, cell_colors>, 3> channels;
+            for(std::size_t color{}; color < cell_colors; ++color) {
+                const auto point{ Metric::to_point(cell_color(cell, color)) };
+                for(std::size_t channel{}; channel < 3; ++channel) {
+                    channels[channel][color] = point[channel];
+                }
+            }
+            std::array<std::int32_t, cell_colors> distances;
+            distances.fill(std::numeric_limits<std::int32_t>::max());
+            for(std::size_t candidate{}; candidate < count; ++candidate) {
+                const auto index{ candidates[candidate] };
+                const auto &target{ points_[index] };
+                for(std::size_t color{}; color < cell_colors; ++color) {
+                    const auto db{ channels[0][color] - target[0] };
+                    const auto dg{ channels[1][color] - target[1] };
+                    const auto dr{ channels[2][color] - target[2] };
+                    const auto distance{ Metric::weights[0] * db * db + Metric::weights[1] * dg * dg +
+                                         Metric::weights[2] * dr * dr };
+                    const bool closer{ distance < distances[color] };
+                    distances[color] = closer ? distance : distances[color];
+                    best[color] = closer ? index : best[color];
+                }
+            }
+        } else {
+            std::array<typename Metric::point, cell_colors> points;
+            for(std::size_t color{}; color < cell_colors; ++color) {
+                points[color] = Metric::to_point(cell_color(cell, color));
+            }
+            if constexpr(requires { Metric::euclidean; }) {
+                lab center{};
+                for(const auto &point : points) {
+                    center = { center.l + point.l / cell_colors, center.a + point.a / cell_colors,
+                               center.b + point.b / cell_colors };
+                }
+                double radius{};
+                for(const auto &point : points) {
+                    radius = std::max(radius, std::sqrt(double{ Metric::distance(point, center) }));
+                }
+                std::array<double, color_table::capacity> nearest;
+                auto bound{ std::numeric_limits<double>::max() };
+                for(std::size_t index{}; index < size_; ++index) {
+                    const auto distance{ std::sqrt(double{ Metric::distance(center, points_[index]) }) };
+                    nearest[index] = std::max(distance - radius, 0.0);
+                    bound = std::min(bound, distance + radius);
+                }
+                // The slack covers the rounding of the distances in single precision.
+                bound = bound * (1 + 1e-3) + 1e-3;
+                for(std::size_t index{}; index < size_; ++index) {
+                    if(nearest[index] <= bound) {
+                        candidates[count++] = static_cast<std::uint8_t>(index);
+                    }
+                }
+            } else {
+                for(; count < size_; ++count) {
+                    candidates[count] = static_cast<std::uint8_t>(count);
+                }
+            }
+            using distance_type = decltype(Metric::distance(points[0], points_[0]));
+            std::array<distance_type, cell_colors> distances;
+            distances.fill(std::numeric_limits<distance_type>::max());
+            for(std::size_t candidate{}; candidate < count; ++candidate) {
+                const auto index{ candidates[candidate] };
+                for(std::size_t color{}; color < cell_colors; ++color) {
+                    const auto distance{ Metric::distance(points[color], points_[index]) };
+                    const bool closer{ distance < distances[color] };
+                    distances[color] = closer ? distance : distances[color];
+                    best[color] = closer ? index : best[color];
+                }
+            }
+        }
+
+        for(std::size_t color{}; color < cell_colors; color += cell_side) {
+            const auto first{ cell_color(cell, color) };
+            const auto key{ std::uint32_t{ first.red } << 16 | std::uint32_t{ first.green } << 8 | first.blue };
+            std::copy_n(best.data() + color, cell_side, entries_ + key);
+        }
+    }
+
+    std::byte search(const rgb_triple &color) const noexcept {
+        const auto pixel{ Metric::to_point(color) };
+        std::size_t best{};
+        auto best_distance{ Metric::distance(pixel, points_[0]) };
+        for(std::size_t index{ 1 }; index < size_; ++index) {
+            if(const auto distance{ Metric::distance(pixel, points_[index]) }; distance < best_distance) {
+                best_distance = distance;
+                best = index;
+            }
+        }
+        return static_cast<std::byte>(best);
+    }
+
+    std::array<typename Metric::point, color_table::capacity> points_{};
+    std::size_t size_{};
+    std::shared_ptr<lookup_table> table_;
+    std::uint8_t *entries_{};
+    std::uint64_t *present_{};
+    const std::uint8_t *complete_{};
+};
+
+}  // namespace color
+
+// Convert one row of 24-bit pixels to a padded row of palette indices, a batch of pixels at a time.
+template<typename Matcher>
+void convert_row(const rgb_triple *pixels, std::byte *row, const bitmap_layout &layout, const Matcher &matcher) noexcept {
+    std::fill_n(row, layout.output_row_size, std::byte{});
+    std::array<std::byte, 64> indices;
+    for(std::size_t first{}; first < layout.width; first += indices.size()) {
+        const auto count{ std::min(indices.size(), layout.width - first) };
+        matcher.closest(pixels + first, count, indices.data());
+        pack_indices(indices.data(), count, first, row, layout);
+    }
+}
+
+// Convert padded 24-bit rows to padded rows of palette indices.
+template<typename Matcher>
+void convert_rows(const std::byte *input, std::byte *output, std::size_t rows, const bitmap_layout &layout,
+                  const Matcher &matcher) noexcept {
+    for(std::size_t row{}; row < rows; ++row) {
+        convert_row(reinterpret_cast<const rgb_triple *>(input + row * layout.input_row_size),
+                    output + row * layout.output_row_size, layout, matcher);
+    }
+}
+
+namespace quantize {
+
+// Color histogram at 5 bits per channel (32768 bins). Besides the pixel count, every bin keeps the channel
+// sums of its pixels, so that palette colors are exact averages rather than bin centers. The arrays are
+// laid out per channel so that merging partial histograms is a plain vectorizable sum.
+class histogram {
+public:
+    static constexpr std::size_t bins{ 1 << 15 };
+
+    histogram()
+        : counts_(bins)
+        , blue_sums_(bins)
+        , green_sums_(bins)
+        , red_sums_(bins) {}
+
+    static constexpr std::size_t bin_of(const rgb_triple &color) noexcept {
+        return (std::size_t{ color.red } >> 3) << 10 | (std::size_t{ color.green } >> 3) << 5 | color.blue >> 3;
+    }
+
+    void add(const rgb_triple *pixels, std::size_t count) noexcept {
+        for(std::size_t index{}; index < count; ++index) {
+            const auto bin{ bin_of(pixels[index]) };
+            ++counts_[bin];
+            blue_sums_[bin] += pixels[index].blue;
+            green_sums_[bin] += pixels[index].green;
+            red_sums_[bin] += pixels[index].red;
+        }
+    }
+
+    void add_rows(const std::byte *input, std::size_t rows, const bitmap_layout &layout) noexcept {
+        for(std::size_t row{}; row < rows; ++row) {
+            add(reinterpret_cast<const rgb_triple *>(input + row * layout.input_row_size), layout.width);
+        }
+    }
+
+    // Bytes held by the bins.
+    static constexpr std::size_t memory_size() noexcept { return 4 * bins * sizeof(std::uint64_t); }
+
+    void merge(const histogram &other) noexcept {
+        for(std::size_t bin{}; bin < bins; ++bin) {
+            counts_[bin] += other.counts_[bin];
+            blue_sums_[bin] += other.blue_sums_[bin];
+            green_sums_[bin] += other.green_sums_[bin];
+            red_sums_[bin] += other.red_sums_[bin];
+        }
+    }
+
+    std::uint64_t count(std::size_t bin) const noexcept { return counts_[bin]; }
+
+    // Text form: the number of non-empty bins, then a line per bin with its index, count and channel sums.
+    void write(std::ostream &stream) const {
+        stream << std::ranges::count_if(counts_, [](std::uint64_t count) { return count != 0; }) << '\n';
+        for(std::size_t bin{}; bin < bins; ++bin) {
+            if(counts_[bin] != 0) {
+                stream << bin << ' ' << counts_[bin] << ' ' << blue_sums_[bin] << ' ' << green_sums_[bin] << ' '
+                       << red_sums_[bin] << '\n';
+            }
+        }
+    }
+
+    bool read(std::istream &stream) {
+        std::size_t occupied{};
+        stream >> occupied;
+        for(std::size_t line{}; line < occupied && stream; ++line) {
+            std::size_t bin{ bins };
+            stream >> bin;
+            if(bin >= bins) {
+                return false;
+            }
+            stream >> counts_[bin] >> blue_sums_[bin] >> green_sums_[bin] >> red_sums_[bin];
+        }
+        return static_cast<bool>(stream);
+    }
+
+    // Average color of the pixels in the given bins.
+    template<typename Bins>
+    rgb_quad average(const Bins &bins) const noexcept {
+        std::uint64_t count{}, blue{}, green{}, red{};
+        for(const auto bin : bins) {
+            count += counts_[bin];
+            blue += blue_sums_[bin];
+            green += green_sums_[bin];
+            red += red_sums_[bin];
+        }
+        if(count == 0) {
+            return {};
+        }
+        return { static_cast<std::uint8_t>((blue + count / 2) / count), static_cast<std::uint8_t>((green + count / 2) / count),
+                 static_cast<std::uint8_t>((red + count / 2) / count), 0 };
+    }
+
+private:
+    std::vector<std::uint64_t> counts_;
+    std::vector<std::uint64_t> blue_sums_;
+    std::vector<std::uint64_t> green_sums_;
+    std::vector<std::uint64_t> red_sums_;
+};
+
+// Set of the distinct 24-bit colors of an image. Large images mark a presence bitmap of 2^24 bits (2 MiB), small
+// ones collect their colors in a list that is sorted and deduplicated on demand, which is far cheaper to clear
+// and merge than the bitmap. Partial sets of the pipeline workers merge by a word-wise OR that compilers vectorize.
+class color_set {
+public:
+    static constexpr std::size_t colors{ std::size_t{ 1 } << 24 };
+    // Images up to this many pixels use the list.
+    static constexpr std::uint64_t sparse_limit{ 1 << 16 };
+
+    explicit color_set(std::uint64_t pixels = colors) {
+        if(pixels > sparse_limit) {
+            bits_.resize(colors / 64);
+        }
+    }
+
+    static constexpr std::uint32_t key_of(const rgb_triple &color) noexcept {
+        return std::uint32_t{ color.red } << 16 | std::uint32_t{ color.green } << 8 | color.blue;
+    }
+
+    void add(const rgb_triple *pixels, std::size_t count) {
+        if(bits_.empty()) {
+            for(std::size_t index{}; index < count; ++index) {
+                sparse_.push_back(key_of(pixels[index]));
+            }
+            return;
+        }
+        for(std::size_t index{}; index < count; ++index) {
+            const auto key{ key_of(pixels[index]) };
+            bits_[key >> 6] |= std::uint64_t{ 1 } << (key & 63);
+        }
+    }
 
-    // Convert input 24-bit BMP to 4-bit.
-    convert_bmp_24_to_4_depth(constants::input_bmp_file_path, constants::output_bmp_file_path);
+    void add_rows(const std::byte *input, std::size_t rows, const bitmap_layout &layout) {
+        for(std::size_t row{}; row < rows; ++row) {
+            add(reinterpret_cast<const rgb_triple *>(input + row * layout.input_row_size), layout.width);
+        }
+    }
+
+    // Bytes held by the bitmap, or by the list at its largest.
+    std::size_t memory_size() const noexcept {
+        return bits_.empty() ? sparse_limit * sizeof(std::uint32_t) : bits_.size() * sizeof(std::uint64_t);
+    }
+
+    void merge(const color_set &other) {
+        if(bits_.empty() && other.bits_.empty()) {
+            sparse_.insert(sparse_.end(), other.sparse_.begin(), other.sparse_.end());
+            return;
+        }
+        if(bits_.empty()) {
+            bits_.resize(colors / 64);
+            for(const auto key : std::exchange(sparse_, {})) {
+                bits_[key >> 6] |= std::uint64_t{ 1 } << (key & 63);
+            }
+        }
+        if(other.bits_.empty()) {
+            for(const auto key : other.sparse_) {
+                bits_[key >> 6] |= std::uint64_t{ 1 } << (key & 63);
+            }
+            return;
+        }
+        for(std::size_t word{}; word < bits_.size(); ++word) {
+            bits_[word] |= other.bits_[word];
+        }
+    }
+
+    // Number of distinct colors.
+    std::uint64_t size() const {
+        if(bits_.empty()) {
+            return unique_keys().size();
+        }
+        std::uint64_t count{};
+        for(const auto word : bits_) {
+            count += static_cast<std::uint64_t>(std::popcount(word));
+        }
+        return count;
+    }
+
+    // The colors themselves, when there are few enough for a palette.
+    std::optional<color_table> exact_palette() const {
+        const auto found{ keys(constants::adaptive_colors) };
+        if(!found) {
+            return std::nullopt;
+        }
+        return palette_of(*found);
+    }
+
+    // The colors as keys, in increasing order, when there are at most `limit` of them.
+    std::optional<std::vector<std::uint32_t>> keys(std::size_t limit) const {
+        std::vector<std::uint32_t> keys;
+        if(bits_.empty()) {
+            keys = unique_keys();
+        } else {
+            for(std::size_t word{}; word < bits_.size() && keys.size() <= limit; ++word) {
+                for(auto bits{ bits_[word] }; bits != 0 && keys.size() <= limit; bits &= bits - 1) {
+                    keys.push_back(static_cast<std::uint32_t>(word * 64 + std::countr_zero(bits)));
+                }
+            }
+        }
+        if(keys.size() > limit) {
+            return std::nullopt;
+        }
+        return keys;
+    }
+
+    static color_table palette_of(std::span<const std::uint32_t> keys) noexcept {
+        color_table palette{ constants::adaptive_colors };
+        for(std::size_t index{}; index < std::min(keys.size(), palette.size()); ++index) {
+            palette[index] = { static_cast<std::uint8_t>(keys[index]), static_cast<std::uint8_t>(keys[index] >> 8),
+                               static_cast<std::uint8_t>(keys[index] >> 16), 0 };
+        }
+        return palette;
+    }
+
+private:
+    std::vector<std::uint32_t> unique_keys() const {
+        auto keys{ sparse_ };
+        std::ranges::sort(keys);
+        keys.erase(std::ranges::unique(keys).begin(), keys.end());
+        return keys;
+    }
+
+    std::vector<std::uint64_t> bits_;
+    std::vector<std::uint32_t> sparse_;
+};
+
+// What the first pass over an image learns about its colors.
+struct statistics {
+    explicit statistics(std::uint64_t pixels)
+        : colors{ pixels } {}
+
+    void add(const rgb_triple *pixels, std::size_t count) {
+        binned.add(pixels, count);
+        colors.add(pixels, count);
+    }
+
+    void add_rows(const std::byte *input, std::size_t rows, const bitmap_layout &layout) {
+        binned.add_rows(input, rows, layout);
+        colors.add_rows(input, rows, layout);
+    }
+
+    std::size_t memory_size() const noexcept { return histogram::memory_size() + colors.memory_size(); }
+
+    void merge(const statistics &other) {
+        binned.merge(other.binned);
+        colors.merge(other.colors);
+    }
+
+    histogram binned;
+    color_set colors;
+};
+
+// Heckbert's median cut over the non-empty bins of a histogram. Boxes live in a fixed array and are split
+// by sorting their part of the bin list in place, so the split phase allocates nothing. The box with the
+// largest population times extent is split at the population median of its longest channel.
+color_table median_cut(const histogram &histogram) {
+    struct box {
+        std::size_t first;
+        std::size_t last;
+        std::uint64_t population;
+        std::size_t channel;  // Longest channel: 0 blue, 1 green, 2 red.
+        std::uint32_t extent;
+    };
+    const auto channel_of{ [](std::uint16_t bin, std::size_t channel) -> std::uint32_t {
+        return (bin >> (5 * channel)) & 0x1F;
+    } };
+    const auto measure{ [&](std::span<const std::uint16_t> bins, box &box) {
+        std::array<std::uint32_t, 3> low{ 31, 31, 31 };
+        std::array<std::uint32_t, 3> high{};
+        box.population = 0;
+        for(const auto bin : bins) {
+            box.population += histogram.count(bin);
+            for(std::size_t channel{}; channel < 3; ++channel) {
+                low[channel] = std::min(low[channel], channel_of(bin, channel));
+                high[channel] = std::max(high[channel], channel_of(bin, channel));
+            }
+        }
+        box.channel = 0;
+        for(std::size_t channel{ 1 }; channel < 3; ++channel) {
+            if(high[channel] - low[channel] > high[box.channel] - low[box.channel]) {
+                box.channel = channel;
+            }
+        }
+        box.extent = bins.empty() ? 0 : high[box.channel] - low[box.channel];
+    } };
+
+    std::vector<std::uint16_t> bins;
+    bins.reserve(histogram::bins);
+    for(std::size_t bin{}; bin < histogram::bins; ++bin) {
+        if(histogram.count(bin) != 0) {
+            bins.push_back(static_cast<std::uint16_t>(bin));
+        }
+    }
+
+    std::array<box, constants::adaptive_colors> boxes;
+    std::size_t box_count{ 1 };
+    boxes[0] = { 0, bins.size(), 0, 0, 0 };
+    measure(bins, boxes[0]);
+    while(box_count < boxes.size()) {
+        auto *widest{ std::ranges::max_element(boxes.begin(), boxes.begin() + box_count, {}, [](const box &box) {
+            return box.last - box.first < 2 ? 0 : box.population * (box.extent + 1);
+        }) };
+        if(widest->last - widest->first < 2) {
+            break;
+        }
+        const std::span part{ bins.begin() + widest->first, bins.begin() + widest->last };
+        const auto channel{ widest->channel };
+        std::ranges::sort(part, [&](std::uint16_t lhs, std::uint16_t rhs) {
+            return std::pair{ channel_of(lhs, channel), lhs } < std::pair{ channel_of(rhs, channel), rhs };
+        });
+        // First bin past half the population, keeping at least one bin on each side.
+        std::size_t split{ 1 };
+        for(std::uint64_t population{ histogram.count(part[0]) }; split < part.size() - 1 && population * 2 < widest->population;
+            ++split) {
+            population += histogram.count(part[split]);
+        }
+        auto &added{ boxes[box_count++] };
+        added = { widest->first + split, widest->last, 0, 0, 0 };
+        widest->last = added.first;
+        measure(part.first(split), *widest);
+        measure(part.subspan(split), added);
+    }
+
+    color_table palette{ constants::adaptive_colors };
+    for(std::size_t index{}; index < box_count; ++index) {
+        palette[index] = histogram.average(std::span{ bins.begin() + boxes[index].first, bins.begin() + boxes[index].last });
+    }
+    return palette;
+}
+
+// Octree quantizer (Gervautz and Purgathofer) fed with the pixels in image order, in a single pass. Nodes come
+// from a pool allocated up front and are linked by index; whenever the leaves outgrow the limit, the least
+// populated node among the deepest ones with children is folded into a leaf and its children return to the
+// free list. Memory therefore stays bounded whatever the image size.
+class octree {
+public:
+    static constexpr std::size_t depth{ 8 };
+
+    explicit octree(std::size_t max_leaves = 256)
+        : max_leaves_{ max_leaves } {
+        // Every interior node lies on the path of a leaf, and one more leaf may exist before a reduction.
+        nodes_.resize((max_leaves + 1) * depth + 1);
+        for(std::uint32_t index{ 1 }; index + 1 < nodes_.size(); ++index) {
+            nodes_[index].next = index + 1;
+        }
+        free_ = nodes_.size() > 1 ? 1 : none;
+        reducible_.fill(none);
+        reducible_[0] = root;
+    }
+
+    void add(const rgb_triple *pixels, std::size_t count) {
+        for(std::size_t index{}; index < count; ++index) {
+            add(pixels[index]);
+        }
+    }
+
+    void add_rows(const std::byte *input, std::size_t rows, const bitmap_layout &layout) {
+        for(std::size_t row{}; row < rows; ++row) {
+            add(reinterpret_cast<const rgb_triple *>(input + row * layout.input_row_size), layout.width);
+        }
+    }
+
+    // Adds `weight` pixels of the given color.
+    void add(const rgb_triple &color, std::uint64_t weight = 1) {
+        auto index{ root };
+        for(std::size_t level{}; !nodes_[index].leaf; ++level) {
+            nodes_[index].count += weight;
+            const auto shift{ 7 - level };
+            const auto octant{ ((color.red >> shift) & 1U) << 2 | ((color.green >> shift) & 1U) << 1 |
+                               ((color.blue >> shift) & 1U) };
+            auto &child{ nodes_[index].children[octant] };
+            if(child == none) {
+                child = allocate(level + 1);
+            }
+            index = child;
+        }
+        auto &leaf{ nodes_[index] };
+        leaf.count += weight;
+        leaf.blue += color.blue * weight;
+        leaf.green += color.green * weight;
+        leaf.red += color.red * weight;
+        while(leaves_ > max_leaves_) {
+            reduce();
+        }
+    }
+
+    // Folds the tree down to the palette size and returns the average colors of the leaves.
+    color_table palette() const {
+        auto tree{ *this };
+        while(tree.leaves_ > constants::adaptive_colors) {
+            tree.reduce();
+        }
+        color_table palette{ constants::adaptive_colors };
+        std::size_t colors{};
+        tree.collect(root, palette, colors);
+        return palette;
+    }
+
+private:
+    static constexpr std::uint32_t none{ std::numeric_limits<std::uint32_t>::max() };
+    static constexpr std::uint32_t root{ 0 };
+
+    struct node {
+        std::uint64_t count{};
+        std::uint64_t blue{};
+        std::uint64_t green{};
+        std::uint64_t red{};
+        std::array<std::uint32_t, 8> children{ none, none, none, none, none, none, none, none };
+        // Next node of the same level with children, or next free node.
+        std::uint32_t next{ none };
+        bool leaf{};
+    };
+
+    std::uint32_t allocate(std::size_t level) {
+        const auto index{ free_ };
+        free_ = nodes_[index].next;
+        nodes_[index] = {};
+        if(level == depth) {
+            nodes_[index].leaf = true;
+            ++leaves_;
+        } else {
+            nodes_[index].next = reducible_[level];
+            reducible_[level] = index;
+        }
+        return index;
+    }
+
+    // Folds the least populated node of the deepest level that has children into a leaf.
+    void reduce() {
+        auto level{ depth - 1 };
+        while(reducible_[level] == none) {
+            --level;
+        }
+        auto *link{ &reducible_[level] };
+        for(auto *candidate{ &nodes_[*link].next }; *candidate != none; candidate = &nodes_[*candidate].next) {
+            if(nodes_[*candidate].count < nodes_[*link].count) {
+                link = candidate;
+            }
+        }
+        const auto index{ *link };
+        auto &folded{ nodes_[index] };
+        *link = folded.next;
+        for(auto &child : folded.children) {
+            if(child != none) {
+                folded.blue += nodes_[child].blue;
+                folded.green += nodes_[child].green;
+                folded.red += nodes_[child].red;
+                nodes_[child].next = free_;
+                free_ = child;
+                --leaves_;
+                child = none;
+            }
+        }
+        folded.leaf = true;
+        folded.next = none;
+        ++leaves_;
+    }
+
+    void collect(std::uint32_t index, color_table &palette, std::size_t &colors) const {
+        const auto &node{ nodes_[index] };
+        if(node.leaf) {
+            if(node.count != 0) {
+                const auto count{ node.count };
+                palette[colors++] = { static_cast<std::uint8_t>((node.blue + count / 2) / count),
+                                      static_cast<std::uint8_t>((node.green + count / 2) / count),
+                                      static_cast<std::uint8_t>((node.red + count / 2) / count), 0 };
+            }
+            return;
+        }
+        for(const auto child : node.children) {
+            if(child != none) {
+                collect(child, palette, colors);
+            }
+        }
+    }
+
+    std::size_t max_leaves_;
+    std::vector<node> nodes_;
+    std::uint32_t free_;
+    std::array<std::uint32_t, depth> reducible_;
+    std::size_t leaves_{};
+};
+
+// Stratified sample of the pixels of an image: the rows are split into strata of 100 / percent rows, one random row
+// is taken from every stratum, and of that row every few pixels from a random offset. Only the sampled rows of the
+// pixel data are read.
+std::vector<rgb_triple> sample_pixels(std::span<const std::byte> pixels, const bitmap_layout &layout, double percent,
+                                      std::uint64_t seed) {
+    const auto stratum{ std::max<std::size_t>(static_cast<std::size_t>(std::lround(100 / percent)), 1) };
+    const auto stride{ std::min(constants::sample_column_stride, layout.width) };
+    std::mt19937_64 engine{ seed };
+    std::vector<rgb_triple> sample;
+    sample.reserve((layout.height + stratum - 1) / stratum * ((layout.width + stride - 1) / stride));
+    for(std::size_t first{}; first < layout.height; first += stratum) {
+        const auto row{ first + engine() % std::min(stratum, layout.height - first) };
+        const auto *colors{ reinterpret_cast<const rgb_triple *>(pixels.data() + row * layout.input_row_size) };
+        for(auto column{ engine() % stride }; column < layout.width; column += stride) {
+            sample.push_back(colors[column]);
+        }
+    }
+    return sample;
+}
+
+// Mean squared distance of the pixels to their closest palette colors.
+double quantization_error(std::span<const rgb_triple> pixels, const color_table &palette) {
+    double error{};
+    for(const auto &pixel : pixels) {
+        const auto &closest{ palette[std::to_integer<std::size_t>(utils::find_closest_color(pixel, palette))] };
+        const auto distance{ utils::color_distance(pixel, closest) };
+        error += distance * distance;
+    }
+    return pixels.empty() ? 0 : error / static_cast<double>(pixels.size());
+}
+
+// Settings of the k-means refinement of a palette.
+struct refinement {
+    // Wall-clock ceiling; the palette of the last finished iteration is kept when it runs out.
+    std::chrono::milliseconds time_budget{ 100 };
+    // Seed of the choice of the colors that replace empty clusters.
+    std::uint64_t seed{};
+    // Stop once no palette color moves by more than this squared distance.
+    std::uint32_t convergence{};
+    std::size_t max_iterations{ 64 };
+};
+
+// Lloyd's k-means starting from the given palette. The points are the non-empty histogram bins, each standing
+// for its pixels by their average color and weighted by their count, so an iteration costs at most 32768
+// points whatever the image size. Points are kept per channel and each palette color is tested against all of
+// them in a branchless loop that compilers vectorize. All arithmetic is integral and empty clusters are
+// reseeded from a fixed-seed generator, so a given seed always yields the same palette unless the time
+// budget cuts the iterations short.
+color_table refine(const histogram &histogram, const color_table &initial, const refinement &settings) {
+    const auto deadline{ std::chrono::steady_clock::now() + settings.time_budget };
+    std::vector<std::int32_t> blue, green, red;
+    std::vector<std::uint64_t> weights;
+    for(std::size_t bin{}; bin < histogram::bins; ++bin) {
+        if(const auto count{ histogram.count(bin) }; count != 0) {
+            const auto color{ histogram.average(std::array{ bin }) };
+            blue.push_back(color.blue);
+            green.push_back(color.green);
+            red.push_back(color.red);
+            weights.push_back(count);
+        }
+    }
+    const auto points{ weights.size() };
+    if(points == 0) {
+        return initial;
+    }
+
+    auto palette{ initial };
+    std::vector<std::int32_t> distances(points);
+    std::vector<std::uint8_t> nearest(points);
+    std::mt19937_64 engine{ settings.seed };
+    for(std::size_t iteration{}; iteration < settings.max_iterations && std::chrono::steady_clock::now() < deadline;
+        ++iteration) {
+        // Assignment step, one palette color at a time over all points.
+        std::ranges::fill(distances, std::numeric_limits<std::int32_t>::max());
+        for(std::size_t index{}; index < palette.size(); ++index) {
+            const std::int32_t center_blue{ palette[index].blue };
+            const std::int32_t center_green{ palette[index].green };
+            const std::int32_t center_red{ palette[index].red };
+            for(std::size_t point{}; point < points; ++point) {
+                const auto db{ blue[point] - center_blue };
+                const auto dg{ green[point] - center_green };
+                const auto dr{ red[point] - center_red };
+                const auto distance{ db * db + dg * dg + dr * dr };
+                const bool closer{ distance < distances[point] };
+                distances[point] = closer ? distance : distances[point];
+                nearest[point] = closer ? static_cast<std::uint8_t>(index) : nearest[point];
+            }
+        }
+
+        // Update step: weighted means of the clusters.
+        std::array<std::array<std::uint64_t, 4>, color_table::capacity> sums{};
+        for(std::size_t point{}; point < points; ++point) {
+            auto &sum{ sums[nearest[point]] };
+            sum[0] += weights[point];
+            sum[1] += weights[point] * static_cast<std::uint64_t>(blue[point]);
+            sum[2] += weights[point] * static_cast<std::uint64_t>(green[point]);
+            sum[3] += weights[point] * static_cast<std::uint64_t>(red[point]);
+        }
+        std::uint32_t movement{};
+        for(std::size_t index{}; index < palette.size(); ++index) {
+            const auto &sum{ sums[index] };
+            rgb_quad center{};
+            if(sum[0] == 0) {
+                const auto point{ engine() % points };
+                center = { static_cast<std::uint8_t>(blue[point]), static_cast<std::uint8_t>(green[point]),
+                           static_cast<std::uint8_t>(red[point]), 0 };
+            } else {
+                center = { static_cast<std::uint8_t>((sum[1] + sum[0] / 2) / sum[0]),
+                           static_cast<std::uint8_t>((sum[2] + sum[0] / 2) / sum[0]),
+                           static_cast<std::uint8_t>((sum[3] + sum[0] / 2) / sum[0]), 0 };
+            }
+            const auto db{ center.blue - palette[index].blue };
+            const auto dg{ center.green - palette[index].green };
+            const auto dr{ center.red - palette[index].red };
+            movement = std::max(movement, static_cast<std::uint32_t>(db * db + dg * dg + dr * dr));
+            palette[index] = center;
+        }
+        if(movement <= settings.convergence) {
+            break;
+        }
+    }
+    return palette;
+}
+
+}  // namespace quantize
+
+namespace pipeline {
+
+// Back off while a ring is full or empty: yield first, then sleep so that an idle stage does not burn a core.
+// (std::atomic::wait is avoided on purpose: libstdc++ 12 can lose its wake-ups.)
+inline void backoff(std::size_t &attempt) noexcept {
+    if(attempt++ < 64) {
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds{ 50 });
+    }
+}
+
+// Lock-free single-producer/single-consumer ring buffer.
+// Producer waits while the ring is full and consumer waits while it is empty (backpressure).
+template<typename T, std::size_t Capacity>
+class spsc_ring {
+    static_assert(std::has_single_bit(Capacity), "Ring capacity must be a power of two");
+
+public:
+    void push(T value) noexcept {
+        const auto tail{ tail_.load(std::memory_order_relaxed) };
+        for(std::size_t attempt{}; tail - head_.load(std::memory_order_acquire) == Capacity;) {
+            backoff(attempt);
+        }
+        slots_[tail & (Capacity - 1)] = std::move(value);
+        tail_.store(tail + 1, std::memory_order_release);
+    }
+
+    T pop() noexcept {
+        std::optional<T> value;
+        for(std::size_t attempt{}; !(value = try_pop());) {
+            backoff(attempt);
+        }
+        return std::move(*value);
+    }
+
+    std::optional<T> try_pop() noexcept {
+        const auto head{ head_.load(std::memory_order_relaxed) };
+        if(tail_.load(std::memory_order_acquire) == head) {
+            return std::nullopt;
+        }
+        std::optional<T> value{ std::move(slots_[head & (Capacity - 1)]) };
+        head_.store(head + 1, std::memory_order_release);
+        return value;
+    }
+
+private:
+    // Indices live on separate cache lines so that producer and consumer do not false-share.
+    alignas(64) std::atomic<std::size_t> head_{};
+    alignas(64) std::atomic<std::size_t> tail_{};
+    std::array<T, Capacity> slots_{};
+};
+
+// State of the asynchronous read or write of a strip.
+enum class io_state : std::uint8_t {
+    queued,
+    done,
+    failed,
+};
+
+// Fixed-size block of rows: padded input pixel rows and the packed output rows converted from them.
+struct strip {
+    std::size_t sequence{};
+    std::size_t first_row{};
+    std::size_t rows{};  // Zero marks the end of the stream.
+    std::size_t buffer_index{};  // Index of `input` and `output` among the buffers registered for I/O.
+    io_state state{};
+    std::size_t transferred{};  // Bytes already read or written by an asynchronous backend.
+    std::vector<std::byte> input;
+    std::vector<std::byte> output;
+};
+
+// Every converter worker owns a lane: its strips and the rings connecting it to the reader and the writer.
+// Strips are dealt to lanes round-robin, so the writer restores the original order by visiting lanes
+// in the same round-robin order, without any reordering buffer.
+struct lane {
+    using ring = spsc_ring<strip *, constants::strips_per_worker>;
+
+    std::array<strip, constants::strips_per_worker> strips;
+    ring free;       // Writer -> reader.
+    ring converted;  // Worker -> writer.
+    ring filled;     // Reader -> worker.
+};
+
+// Strip height and number of converter workers of a conversion.
+struct plan {
+    std::size_t strip_rows;
+    std::size_t workers;
+};
+
+// Pick the tallest strips (up to `max_strip_rows`, and `max_row_size` bytes per buffer) that keep all strip buffers
+// within `memory_budget` bytes, dropping workers when even single-row strips do not fit. Strips are a multiple of
+// `block_rows` high. Only the last resort (one worker with strips of `block_rows` rows) may exceed the budget.
+constexpr plan make_plan(std::size_t input_row_size, std::size_t output_row_size, std::size_t workers,
+                         std::size_t memory_budget, std::size_t block_rows = 1) noexcept {
+    const auto strip_row_size{ constants::strips_per_worker * (input_row_size + output_row_size) };
+    const auto block_size{ strip_row_size * block_rows };
+    workers = std::clamp<std::size_t>(memory_budget / block_size, 1, std::max<std::size_t>(workers, 1));
+    const auto max_rows{ std::clamp<std::size_t>(
+        constants::max_row_size / std::max<std::size_t>({ input_row_size, output_row_size, 1 }), 1,
+        constants::max_strip_rows) };
+    const auto blocks{ std::clamp<std::size_t>(memory_budget / (block_size * workers), 1,
+                                               std::max<std::size_t>(max_rows / block_rows, 1)) };
+    return { blocks * block_rows, workers };
+}
+
+// Run the reader stage on the calling thread, and `plan.workers` converter threads plus a writer thread.
+// The reader and the writer keep as many strips in flight as the I/O backends accept:
+//   source.queue(strip &) starts reading `strip::rows` rows into `strip::input`,
+//   sink.queue(const strip &) starts writing `strip::output`;
+//   poll() collects finished requests without blocking and wait() blocks until at least one finishes.
+// Both report completion through `strip::state`; blocking backends finish requests inside queue().
+//   convert(strip &) fills `strip::output` from `strip::input`.
+template<typename Source, typename Convert, typename Sink>
+void run(std::size_t total_rows, const plan &plan, std::size_t input_row_size, std::size_t output_row_size,
+         Source &source, Convert &&convert, Sink &sink) {
+    std::vector<lane> lanes(plan.workers);
+    std::size_t buffer_index{};
+    for(auto &lane : lanes) {
+        for(auto &strip : lane.strips) {
+            strip.buffer_index = buffer_index++;
+            strip.input.resize(plan.strip_rows * input_row_size);
+            strip.output.resize(plan.strip_rows * output_row_size);
+            lane.free.push(&strip);
+        }
+    }
+    const auto lane_of{ [&lanes](const strip &strip) -> lane & { return lanes[strip.sequence % lanes.size()]; } };
+    source.register_buffers(lanes);
+    sink.register_buffers(lanes);
+
+    std::vector<std::jthread> threads;
+    for(auto &lane : lanes) {
+        threads.emplace_back([&lane, &convert] {
+            for(;;) {
+                auto *strip{ lane.filled.pop() };
+                if(strip->rows != 0) {
+                    convert(*strip);
+                }
+                lane.converted.push(strip);
+                if(strip->rows == 0) {
+                    return;
+                }
+            }
+        });
+    }
+    threads.emplace_back([&lanes, &lane_of, &sink] {
+        std::deque<strip *> in_flight;
+        bool end_of_stream{};
+        std::size_t attempt{};
+        for(std::size_t index{};;) {
+            std::size_t queued{};
+            while(!end_of_stream) {
+                auto strip{ lanes[index % lanes.size()].converted.try_pop() };
+                if(!strip) {
+                    break;
+                }
+                if((*strip)->rows == 0) {
+                    end_of_stream = true;
+                    break;
+                }
+                sink.queue(**strip);
+                in_flight.push_back(*strip);
+                ++index;
+                ++queued;
+                if((*strip)->state != io_state::queued) {
+                    break;
+                }
+            }
+            if(in_flight.empty()) {
+                if(end_of_stream) {
+                    return;
+                }
+                backoff(attempt);
+                continue;
+            }
+            attempt = 0;
+            sink.poll();
+            if(queued == 0 && in_flight.front()->state == io_state::queued) {
+                sink.wait();
+            }
+            for(; !in_flight.empty() && in_flight.front()->state != io_state::queued; in_flight.pop_front()) {
+                lane_of(*in_flight.front()).free.push(in_flight.front());
+            }
+        }
+    });
+
+    // Reader stage. Strips read after a failure are not handed over; the reader keeps them apart (the `free` ring
+    // of a lane has a single producer, the writer) and reuses them for the end-of-stream markers.
+    std::deque<strip *> in_flight;
+    std::vector<std::vector<strip *>> kept(lanes.size());
+    bool failed{};
+    std::size_t index{};
+    std::size_t handed_over{};
+    std::size_t attempt{};
+    for(std::size_t row{};;) {
+        std::size_t queued{};
+        while(!failed && row < total_rows) {
+            auto strip{ lanes[index % lanes.size()].free.try_pop() };
+            if(!strip) {
+                break;
+            }
+            (*strip)->sequence = index++;
+            (*strip)->first_row = row;
+            (*strip)->rows = std::min(plan.strip_rows, total_rows - row);
+            row += (*strip)->rows;
+            source.queue(**strip);
+            in_flight.push_back(*strip);
+            ++queued;
+            if((*strip)->state != io_state::queued) {
+                break;
+            }
+        }
+        if(in_flight.empty()) {
+            if(failed || row >= total_rows) {
+                break;
+            }
+            backoff(attempt);
+            continue;
+        }
+        attempt = 0;
+        source.poll();
+        if(queued == 0 && in_flight.front()->state == io_state::queued) {
+            source.wait();
+        }
+        for(; !in_flight.empty() && in_flight.front()->state != io_state::queued; in_flight.pop_front()) {
+            auto *strip{ in_flight.front() };
+            // After a failed read, keep the remaining strips: the end-of-stream marker shuts the pipeline down.
+            failed = failed || strip->state == io_state::failed;
+            if(failed) {
+                kept[strip->sequence % lanes.size()].push_back(strip);
+            } else {
+                lane_of(*strip).filled.push(strip);
+                ++handed_over;
+            }
+        }
+    }
+    // End-of-stream marker for every lane, starting with the lane of the strip after the last one handed over.
+    for(std::size_t i{}, index{ handed_over }; i < lanes.size(); ++i, ++index) {
+        auto &lane{ lanes[index % lanes.size()] };
+        auto &kept_strips{ kept[index % lanes.size()] };
+        auto *strip{ kept_strips.empty() ? lane.free.pop() : kept_strips.back() };
+        strip->rows = 0;
+        lane.filled.push(strip);
+    }
+}
+
+}  // namespace pipeline
+
+namespace io {
+
+// Common part of the I/O backends: default no-op hooks and failure tracking.
+class backend {
+public:
+    bool failed() const noexcept { return failed_; }
+
+    template<typename Lanes>
+    void register_buffers(Lanes &) noexcept {}
+    void poll() noexcept {}
+    void wait() noexcept {}
+
+protected:
+    void complete(pipeline::strip &strip, bool success) noexcept {
+        strip.state = success ? pipeline::io_state::done : pipeline::io_state::failed;
+        failed_ = failed_ || !success;
+    }
+
+private:
+    bool failed_{};
+};
+
+// Portable backend: blocking reads on the reader thread, overlapped with conversion by the pipeline threads.
+class stream_source : public backend {
+public:
+    stream_source(std::istream &stream, std::size_t row_size)
+        : stream_{ stream }
+        , row_size_{ row_size } {}
+
+    void queue(pipeline::strip &strip) {
+        stream_.read(reinterpret_cast<char *>(strip.input.data()), strip.rows * row_size_);
+        complete(strip, static_cast<bool>(stream_));
+    }
+
+private:
+    std::istream &stream_;
+    std::size_t row_size_;
+};
+
+// Blocking backend reading a window of the image: the needed bytes of every needed row, each into a padded row of
+// its own. Seekable streams seek from row to row; others (stdin) skip the bytes in between.
+class window_source : public backend {
+public:
+    // Rows of the window lie `stride` bytes apart from `first_offset` on, `row_bytes` bytes each; the stream is
+    // at `position`.
+    window_source(std::istream &stream, bool seekable, std::uint64_t position, std::uint64_t first_offset,
+                  std::size_t stride, std::size_t row_bytes, std::size_t row_size)
+        : stream_{ stream }
+        , seekable_{ seekable }
+        , position_{ position }
+        , first_offset_{ first_offset }
+        , stride_{ stride }
+        , row_bytes_{ row_bytes }
+        , row_size_{ row_size } {}
+
+    void queue(pipeline::strip &strip) {
+        bool read{ true };
+        for(std::size_t row{}; row < strip.rows && read; ++row) {
+            const auto offset{ first_offset_ + std::uint64_t{ strip.first_row + row } * stride_ };
+            if(seekable_) {
+                stream_.seekg(static_cast<std::streamoff>(offset));
+            } else {
+                stream_.ignore(static_cast<std::streamsize>(offset - position_));
+            }
+            stream_.read(reinterpret_cast<char *>(strip.input.data() + row * row_size_), static_cast<std::streamsize>(row_bytes_));
+            position_ = offset + row_bytes_;
+            read = static_cast<bool>(stream_);
+        }
+        complete(strip, read);
+    }
+
+private:
+    std::istream &stream_;
+    bool seekable_;
+    std::uint64_t position_;
+    std::uint64_t first_offset_;
+    std::size_t stride_;
+    std::size_t row_bytes_;
+    std::size_t row_size_;
+};
+
+// Portable backend: blocking writes on the writer thread.
+class stream_sink : public backend {
+public:
+    stream_sink(std::ostream &stream, std::size_t row_size)
+        : stream_{ stream }
+        , row_size_{ row_size } {}
+
+    void queue(pipeline::strip &strip) {
+        stream_.write(reinterpret_cast<const char *>(strip.output.data()), strip.rows * row_size_);
+        complete(strip, static_cast<bool>(stream_));
+    }
+
+private:
+    std::ostream &stream_;
+    std::size_t row_size_;
+};
+
+// Backend writing several outputs converted from the same strips. The output buffer of a strip holds the rows of
+// every output one block after the other, each block as high as the tallest strip. An output may have fewer rows
+// than the strip: one for every 2^shift rows (or part of them, at the end).
+class fan_out_sink : public backend {
+public:
+    struct output {
+        std::ostream *stream;
+        std::size_t row_size;
+        std::size_t offset;  // Of the block in the output buffer of a strip.
+        std::size_t shift{};
+    };
+
+    explicit fan_out_sink(std::vector<output> outputs)
+        : outputs_{ std::move(outputs) } {}
+
+    void queue(pipeline::strip &strip) {
+        bool written{ true };
+        for(const auto &output : outputs_) {
+            const auto rows{ (strip.rows + (std::size_t{ 1 } << output.shift) - 1) >> output.shift };
+            output.stream->write(reinterpret_cast<const char *>(strip.output.data() + output.offset),
+                                 static_cast<std::streamsize>(rows * output.row_size));
+            written = written && static_cast<bool>(*output.stream);
+        }
+        complete(strip, written);
+    }
+
+private:
+    std::vector<output> outputs_;
+};
+
+// Backend collecting the converted rows in memory, for stages that need the whole image.
+class memory_sink : public backend {
+public:
+    memory_sink(std::size_t row_size, std::size_t rows)
+        : image_(row_size * rows)
+        , row_size_{ row_size } {}
+
+    void queue(pipeline::strip &strip) {
+        std::copy_n(strip.output.data(), strip.rows * row_size_, image_.data() + strip.first_row * row_size_);
+        complete(strip, true);
+    }
+
+    const std::vector<std::byte> &image() const noexcept { return image_; }
+
+private:
+    std::vector<std::byte> image_;
+    std::size_t row_size_;
+};
+
+// Backend that discards strips, for passes that only read the image.
+class null_sink : public backend {
+public:
+    void queue(pipeline::strip &strip) noexcept { complete(strip, true); }
+};
+
+#ifdef SETM_BMP_MMAP
+
+// Owning POSIX file descriptor.
+class file_descriptor {
+public:
+    file_descriptor() = default;
+    explicit file_descriptor(int fd) noexcept
+        : fd_{ fd } {}
+    file_descriptor(file_descriptor &&other) noexcept
+        : fd_{ std::exchange(other.fd_, -1) } {}
+    file_descriptor &operator=(file_descriptor &&other) noexcept {
+        std::swap(fd_, other.fd_);
+        return *this;
+    }
+    ~file_descriptor() {
+        if(fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+
+    int get() const noexcept { return fd_; }
+    explicit operator bool() const noexcept { return fd_ >= 0; }
+
+private:
+    int fd_{ -1 };
+};
+
+// Read-only mapping of a whole file. The pages are advised for random access, so that only those touched are read.
+class mapped_file {
+public:
+    explicit mapped_file(const fs::path &path) {
+        const file_descriptor fd{ ::open(path.c_str(), O_RDONLY | O_CLOEXEC) };
+        struct stat status {};
+        if(!fd || ::fstat(fd.get(), &status) != 0 || status.st_size <= 0) {
+            return;
+        }
+        const auto size{ static_cast<std::size_t>(status.st_size) };
+        auto *data{ ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0) };
+        if(data == MAP_FAILED) {
+            return;
+        }
+        ::madvise(data, size, MADV_RANDOM);
+        data_ = static_cast<const std::byte *>(data);
+        size_ = size;
+    }
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+    ~mapped_file() {
+        if(data_) {
+            ::munmap(const_cast<std::byte *>(data_), size_);
+        }
+    }
+
+    std::span<const std::byte> bytes() const noexcept { return { data_, size_ }; }
+    explicit operator bool() const noexcept { return data_ != nullptr; }
+
+private:
+    const std::byte *data_{};
+    std::size_t size_{};
+};
+
+#endif
+
+#ifdef SETM_BMP_IO_URING
+
+// Minimal io_uring driver on top of the raw system calls (no liburing dependency).
+class uring {
+public:
+    explicit uring(unsigned entries) {
+        io_uring_params params{};
+        fd_ = file_descriptor{ static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params)) };
+        if(!fd_) {
+            return;
+        }
+        sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if(params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe *>(map(sqes_size_, IORING_OFF_SQES));
+        if(!sq_ring_ || !cq_ring_ || !sqes_) {
+            fd_ = file_descriptor{};
+            return;
+        }
+        const auto field{ [](void *ring, std::uint32_t offset) {
+            return reinterpret_cast<unsigned *>(static_cast<std::byte *>(ring) + offset);
+        } };
+        sq_head_ = field(sq_ring_, params.sq_off.head);
+        sq_tail_ = field(sq_ring_, params.sq_off.tail);
+        sq_mask_ = *field(sq_ring_, params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_array_ = field(sq_ring_, params.sq_off.array);
+        cq_head_ = field(cq_ring_, params.cq_off.head);
+        cq_tail_ = field(cq_ring_, params.cq_off.tail);
+        cq_mask_ = *field(cq_ring_, params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(static_cast<std::byte *>(cq_ring_) + params.cq_off.cqes);
+        local_tail_ = *sq_tail_;
+    }
+
+    uring(const uring &) = delete;
+    uring &operator=(const uring &) = delete;
+
+    ~uring() {
+        if(sqes_) {
+            ::munmap(sqes_, sqes_size_);
+        }
+        if(cq_ring_ && cq_ring_ != sq_ring_) {
+            ::munmap(cq_ring_, cq_ring_size_);
+        }
+        if(sq_ring_) {
+            ::munmap(sq_ring_, sq_ring_size_);
+        }
+    }
+
+    // False when the kernel does not provide io_uring (too old, disabled or filtered by seccomp).
+    explicit operator bool() const noexcept { return static_cast<bool>(fd_); }
+
+    bool register_buffers(std::span<const iovec> buffers) noexcept {
+        return ::syscall(__NR_io_uring_register, fd_.get(), IORING_REGISTER_BUFFERS, buffers.data(),
+                         static_cast<unsigned>(buffers.size())) == 0;
+    }
+
+    // Next free submission queue entry, submitting the queued ones first if the queue is full. A link chain under
+    // way is ended at the last queued entry first, so that no submission carries an unterminated chain.
+    io_uring_sqe &next_sqe() noexcept {
+        while(local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_) {
+            if(last_sqe_) {
+                last_sqe_->flags &= ~IOSQE_IO_LINK;
+            }
+            submit(0);
+        }
+        const auto index{ local_tail_++ & sq_mask_ };
+        sq_array_[index] = index;
+        auto &sqe{ sqes_[index] };
+        sqe = io_uring_sqe{};
+        last_sqe_ = &sqe;
+        return sqe;
+    }
+
+    // The most recently prepared entry, if it has not been submitted yet.
+    io_uring_sqe *last_sqe() noexcept { return last_sqe_; }
+
+    // Submit all prepared entries with a single system call and optionally wait for completions.
+    void submit(unsigned wait_for) noexcept {
+        __atomic_store_n(sq_tail_, local_tail_, __ATOMIC_RELEASE);
+        const auto pending{ local_tail_ - submitted_tail_ };
+        if(pending == 0 && wait_for == 0) {
+            return;
+        }
+        const auto result{ ::syscall(__NR_io_uring_enter, fd_.get(), pending, wait_for,
+                                     wait_for ? IORING_ENTER_GETEVENTS : 0U, nullptr, 0) };
+        if(result >= 0) {
+            submitted_tail_ += static_cast<unsigned>(result);
+            last_sqe_ = nullptr;
+        }
+    }
+
+    struct completion {
+        std::uint64_t user_data;
+        std::int32_t result;
+    };
+
+    std::optional<completion> pop_completion() noexcept {
+        const auto head{ *cq_head_ };
+        if(head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            return std::nullopt;
+        }
+        const auto &cqe{ cqes_[head & cq_mask_] };
+        const completion result{ cqe.user_data, cqe.res };
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        return result;
+    }
+
+private:
+    void *map(std::size_t size, std::uint64_t offset) const noexcept {
+        auto *address{ ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_.get(),
+                               static_cast<off_t>(offset)) };
+        return address == MAP_FAILED ? nullptr : address;
+    }
+
+    file_descriptor fd_;
+    std::size_t sq_ring_size_{};
+    std::size_t cq_ring_size_{};
+    std::size_t sqes_size_{};
+    void *sq_ring_{};
+    void *cq_ring_{};
+    io_uring_sqe *sqes_{};
+    unsigned *sq_head_{};
+    unsigned *sq_tail_{};
+    unsigned *sq_array_{};
+    unsigned sq_mask_{};
+    unsigned sq_entries_{};
+    unsigned *cq_head_{};
+    unsigned *cq_tail_{};
+    unsigned cq_mask_{};
+    io_uring_cqe *cqes_{};
+    unsigned local_tail_{};
+    unsigned submitted_tail_{};
+    io_uring_sqe *last_sqe_{};
+};
+
+// Asynchronous strip I/O at precomputed file offsets through io_uring.
+// The strip buffers are registered once, so reads and writes use the *_FIXED opcodes and skip per-request
+// page pinning. Consecutive writes are linked into chains, so they complete in file order.
+template<bool Write>
+class uring_backend : public backend {
+public:
+    uring_backend(uring &ring, int fd, std::uint64_t offset, std::size_t row_size) noexcept
+        : ring_{ ring }
+        , fd_{ fd }
+        , offset_{ offset }
+        , row_size_{ row_size } {}
+
+    template<typename Lanes>
+    void register_buffers(Lanes &lanes) {
+        std::vector<iovec> buffers;
+        for(auto &lane : lanes) {
+            for(auto &strip : lane.strips) {
+                auto &buffer{ Write ? strip.output : strip.input };
+                buffers.push_back(iovec{ buffer.data(), buffer.size() });
+            }
+        }
+        // Registration counts against RLIMIT_MEMLOCK; plain opcodes are used when it is refused.
+        fixed_ = ring_.register_buffers(buffers);
+    }
+
+    void queue(pipeline::strip &strip) noexcept {
+        strip.transferred = 0;
+        strip.state = pipeline::io_state::queued;
+        resume(strip);
+    }
+
+    void poll() noexcept {
+        submit(0);
+        reap();
+    }
+
+    void wait() noexcept {
+        submit(1);
+        reap();
+    }
+
+private:
+    // Queue the part of the strip that has not been transferred yet.
+    void resume(pipeline::strip &strip) noexcept {
+        auto &buffer{ Write ? strip.output : strip.input };
+        auto &sqe{ ring_.next_sqe() };
+        sqe.opcode = Write ? (fixed_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE)
+                           : (fixed_ ? IORING_OP_READ_FIXED : IORING_OP_READ);
+        sqe.fd = fd_;
+        sqe.addr = reinterpret_cast<std::uint64_t>(buffer.data() + strip.transferred);
+        sqe.len = static_cast<std::uint32_t>(strip.rows * row_size_ - strip.transferred);
+        sqe.off = offset_ + std::uint64_t{ strip.first_row } * row_size_ + strip.transferred;
+        sqe.buf_index = static_cast<std::uint16_t>(fixed_ ? strip.buffer_index : 0);
+        sqe.flags = Write ? IOSQE_IO_LINK : 0;
+        sqe.user_data = reinterpret_cast<std::uint64_t>(&strip);
+    }
+
+    void submit(unsigned wait_for) noexcept {
+        // A chain ends with the last write of the submission.
+        if(auto *last{ ring_.last_sqe() }) {
+            last->flags &= ~IOSQE_IO_LINK;
+        }
+        ring_.submit(wait_for);
+    }
+
+    // Short transfers (normal on network file systems) are resubmitted for the rest of the strip; so are the writes
+    // that a short write cancelled further down its chain. The resubmissions go out with the next poll() or wait().
+    void reap() noexcept {
+        while(const auto cqe{ ring_.pop_completion() }) {
+            auto &strip{ *reinterpret_cast<pipeline::strip *>(cqe->user_data) };
+            if(cqe->result > 0) {
+                strip.transferred += static_cast<std::size_t>(cqe->result);
+            }
+            const auto size{ strip.rows * row_size_ };
+            if(strip.transferred == size) {
+                complete(strip, true);
+            } else if(cqe->result > 0 || (Write && cqe->result == -ECANCELED)) {
+                resume(strip);
+            } else {
+                complete(strip, false);
+            }
+        }
+    }
+
+    uring &ring_;
+    int fd_;
+    std::uint64_t offset_;
+    std::size_t row_size_;
+    bool fixed_{};
+};
+
+using uring_source = uring_backend<false>;
+using uring_sink = uring_backend<true>;
+
+#endif
+
+}  // namespace io
+
+namespace resample {
+
+// Kernels of the resampling filters, stretched by the scale factor when downscaling.
+enum class filter {
+    box,       // Area average.
+    bilinear,  // Triangle.
+    lanczos,   // Lanczos with two lobes.
+};
+
+// Weights are integers summing to this.
+constexpr std::int32_t weight_one{ 1 << 14 };
+
+// Input samples contributing to every output sample along one axis.
+struct axis {
+    std::vector<std::size_t> first;
+    std::vector<std::size_t> count;
+    std::vector<std::int32_t> weights;  // `max_count` per output sample.
+    std::size_t max_count{};
+
+    axis(std::size_t input_size, std::size_t output_size, filter filter) {
+        const auto scale{ static_cast<double>(input_size) / output_size };
+        const auto stretch{ std::max(scale, 1.0) };
+        const auto radius{ filter == filter::box ? 0.5 : filter == filter::bilinear ? 1.0 : 2.0 };
+        const auto kernel{ [filter](double x) {
+            x = std::abs(x);
+            switch(filter) {
+            case filter::box:
+                return x < 0.5 ? 1.0 : 0.0;
+            case filter::bilinear:
+                return std::max(1 - x, 0.0);
+            case filter::lanczos:
+                break;
+            }
+            const auto sinc{ [](double x) {
+                constexpr auto pi{ 3.14159265358979323846 };
+                return x == 0 ? 1.0 : std::sin(pi * x) / (pi * x);
+            } };
+            return x < 2 ? sinc(x) * sinc(x / 2) : 0.0;
+        } };
+        max_count = static_cast<std::size_t>(std::ceil(radius * stretch)) * 2 + 1;
+        first.resize(output_size);
+        count.resize(output_size);
+        weights.resize(output_size * max_count);
+        std::vector<double> raw(max_count);
+        for(std::size_t index{}; index < output_size; ++index) {
+            const auto center{ (static_cast<double>(index) + 0.5) * scale };
+            const auto low{ static_cast<std::size_t>(std::max(std::floor(center - radius * stretch + 0.5), 0.0)) };
+            const auto high{ std::min(static_cast<std::size_t>(std::max(std::floor(center + radius * stretch + 0.5), 0.0)),
+                                      input_size) };
+            // Far enough from the edges, or with tiny images, the kernel may miss every sample: take the nearest.
+            first[index] = std::min(low, input_size - 1);
+            count[index] = std::clamp<std::size_t>(high - std::min(low, high), 1, max_count);
+            double total{};
+            for(std::size_t sample{}; sample < count[index]; ++sample) {
+                raw[sample] = kernel((static_cast<double>(first[index] + sample) + 0.5 - center) / stretch);
+                total += raw[sample];
+            }
+            auto *row{ weights.data() + index * max_count };
+            std::int32_t sum{};
+            std::size_t largest{};
+            for(std::size_t sample{}; sample < count[index]; ++sample) {
+                row[sample] = total != 0 ? static_cast<std::int32_t>(std::lround(raw[sample] / total * weight_one))
+                                         : (sample == 0 ? weight_one : 0);
+                sum += row[sample];
+                largest = row[sample] > row[largest] ? sample : largest;
+            }
+            // Rounding is absorbed by the largest weight, so that flat areas keep their exact color.
+            row[largest] += weight_one - sum;
+        }
+    }
+};
+
+// Backend reading the rows of the image in order and handing out resampled rows: every input row is resampled
+// horizontally once into a ring holding as many rows as the vertical filter spans, and every output row is
+// combined from the ring. The full-size image is never held, nor the resampled one: rows go to the strips of
+// the pipeline, and on to the palette matcher. Channels stay integral (14-bit weights, 64-bit sums).
+class source : public io::backend {
+public:
+    source(std::istream &stream, std::size_t input_width, std::size_t input_row_size, std::size_t input_height,
+           std::size_t output_width, std::size_t output_height, std::size_t output_row_size, filter filter)
+        : stream_{ stream }
+        , input_row_(input_row_size)
+        , output_row_size_{ output_row_size }
+        , horizontal_{ input_width, output_width, filter }
+        , vertical_{ input_height, output_height, filter }
+        , ring_rows_{ vertical_.max_count }
+        , ring_(ring_rows_ * output_width * 3) {}
+
+    void queue(pipeline::strip &strip) {
+        bool read{ true };
+        for(std::size_t row{}; row < strip.rows && read; ++row) {
+            const auto output_row{ strip.first_row + row };
+            const auto last{ vertical_.first[output_row] + vertical_.count[output_row] };
+            for(; read && rows_read_ < last; ++rows_read_) {
+                read = read_row(rows_read_);
+            }
+            if(read) {
+                combine(output_row, strip.input.data() + row * output_row_size_);
+            }
+        }
+        complete(strip, read);
+    }
+
+private:
+    bool read_row(std::size_t input_row) {
+        stream_.read(reinterpret_cast<char *>(input_row_.data()), static_cast<std::streamsize>(input_row_.size()));
+        if(!stream_) {
+            return false;
+        }
+        const auto width{ horizontal_.first.size() };
+        auto *target{ ring_.data() + input_row % ring_rows_ * width * 3 };
+        for(std::size_t column{}; column < width; ++column) {
+            const auto *weights{ horizontal_.weights.data() + column * horizontal_.max_count };
+            const auto *pixels{ reinterpret_cast<const std::uint8_t *>(input_row_.data()) + horizontal_.first[column] * 3 };
+            std::array<std::int32_t, 3> sums{};
+            for(std::size_t sample{}; sample < horizontal_.count[column]; ++sample) {
+                for(std::size_t channel{}; channel < 3; ++channel) {
+                    sums[channel] += weights[sample] * pixels[sample * 3 + channel];
+                }
+            }
+            std::copy(sums.begin(), sums.end(), target + column * 3);
+        }
+        return true;
+    }
+
+    void combine(std::size_t output_row, std::byte *output) const noexcept {
+        const auto values{ horizontal_.first.size() * 3 };
+        const auto *weights{ vertical_.weights.data() + output_row * vertical_.max_count };
+        for(std::size_t value{}; value < values; ++value) {
+            std::int64_t sum{};
+            for(std::size_t sample{}; sample < vertical_.count[output_row]; ++sample) {
+                const auto input_row{ vertical_.first[output_row] + sample };
+                sum += std::int64_t{ weights[sample] } * ring_[input_row % ring_rows_ * values + value];
+            }
+            constexpr auto shift{ 2 * std::countr_zero(static_cast<std::uint32_t>(weight_one)) };
+            output[value] = static_cast<std::byte>(std::clamp<std::int64_t>((sum + (std::int64_t{ 1 } << (shift - 1))) >> shift, 0, 255));
+        }
+    }
+
+    std::istream &stream_;
+    std::vector<std::byte> input_row_;
+    std::size_t output_row_size_;
+    axis horizontal_;
+    axis vertical_;
+    std::size_t ring_rows_;
+    std::vector<std::int32_t> ring_;
+    std::size_t rows_read_{};
+};
+
+}  // namespace resample
+
+namespace dither {
+
+// Floyd–Steinberg error diffusion, run as a wavefront over rows.
+// Row `r` is converted by team member `r % threads` and trails row `r - 1` by a couple of pixels: pixel `x`
+// only needs the error that row `r - 1` has pushed down up to pixel `x + 1`. Errors are integers scaled by 16,
+// and every pixel sees the same contributions in the same order whatever the thread count, so the output is
+// deterministic. Rows are numbered across calls, so the error carries over from one strip to the next.
+template<typename Matcher>
+class floyd_steinberg {
+public:
+    floyd_steinberg(const bitmap_layout &layout, const Matcher &matcher, const color::transfer &transfer,
+                    std::size_t threads)
+        : layout_{ layout }
+        , matcher_{ matcher }
+        , transfer_{ transfer }
+        , threads_{ std::max<std::size_t>(threads, 1) }
+        , ring_rows_{ threads_ + 2 }
+        , errors_(ring_rows_ * error_row_size())
+        , progress_(ring_rows_) {
+        for(std::size_t index{}; index < layout.palette.size(); ++index) {
+            const auto &color{ layout.palette[index] };
+            palette_levels_[index] = { transfer.decode[color.blue], transfer.decode[color.green], transfer.decode[color.red] };
+        }
+        for(std::size_t member{ 1 }; member < threads_; ++member) {
+            team_.emplace_back([this, member](std::stop_token stop) {
+                for(std::size_t generation{ 1 };; ++generation) {
+                    for(std::size_t attempt{}; generation_.load(std::memory_order_acquire) != generation;) {
+                        if(stop.stop_requested()) {
+                            return;
+                        }
+                        pipeline::backoff(attempt);
+                    }
+                    convert_rows(member);
+                    finished_.fetch_add(1, std::memory_order_release);
+                }
+            });
+        }
+    }
+
+    ~floyd_steinberg() {
+        for(auto &member : team_) {
+            member.request_stop();
+        }
+    }
+
+    // Convert the next `rows` rows of the image. Calls must follow image order.
+    void convert(const std::byte *input, std::byte *output, std::size_t rows) noexcept {
+        input_ = input;
+        output_ = output;
+        rows_ = rows;
+        const auto generation{ generation_.load(std::memory_order_relaxed) + 1 };
+        generation_.store(generation, std::memory_order_release);
+        convert_rows(0);
+        for(std::size_t attempt{}; finished_.load(std::memory_order_acquire) != generation * (threads_ - 1);) {
+            pipeline::backoff(attempt);
+        }
+        first_row_ += rows;
+    }
+
+private:
+    // Errors for one row: three channels per pixel, plus a guard pixel on each side.
+    std::size_t error_row_size() const noexcept { return (layout_.width + 2) * 3; }
+
+    // Errors pushed down onto image row `row`, kept in a ring of `threads + 2` rows.
+    std::int32_t *errors(std::size_t row) noexcept { return errors_.data() + (row % ring_rows_) * error_row_size(); }
+
+    // Progress of row `row`, tagged with the row so that a stale value left by an older row in the same
+    // ring slot is always smaller.
+    std::uint64_t progress_mark(std::size_t row, std::size_t pixels) const noexcept {
+        return std::uint64_t{ row } * (layout_.width + 1) + pixels;
+    }
+
+    void convert_rows(std::size_t member) noexcept {
+        for(auto row{ (member + threads_ - first_row_ % threads_) % threads_ }; row < rows_; row += threads_) {
+            convert_row(row);
+        }
+    }
+
+    void convert_row(std::size_t row) noexcept {
+        const auto image_row{ first_row_ + row };
+        const auto *pixels{ reinterpret_cast<const rgb_triple *>(input_ + row * layout_.input_row_size) };
+        auto *indices{ output_ + row * layout_.output_row_size };
+        // The row two rows up finished before this thread's previous row did, so its slot is free to reuse.
+        auto *below{ errors(image_row + 1) };
+        std::fill_n(below, error_row_size(), 0);
+        const auto *above{ errors(image_row) };
+        auto &above_progress{ progress_[(image_row + ring_rows_ - 1) % ring_rows_] };
+        auto &own_progress{ progress_[image_row % ring_rows_] };
+
+        std::fill_n(indices, layout_.output_row_size, std::byte{});
+        std::array<std::int32_t, 3> right{};
+        std::uint64_t available{};
+        for(std::size_t column{}; column < layout_.width; ++column) {
+            if(image_row != 0) {
+                const auto needed{ progress_mark(image_row - 1, std::min(column + 2, layout_.width)) };
+                for(std::size_t attempt{}; available < needed;) {
+                    if((available = above_progress.load(std::memory_order_acquire)) < needed) {
+                        pipeline::backoff(attempt);
+                    }
+                }
+            }
+
+            const std::array<std::int32_t, 3> channels{ transfer_.decode[pixels[column].blue],
+                                                        transfer_.decode[pixels[column].green],
+                                                        transfer_.decode[pixels[column].red] };
+            std::array<std::int32_t, 3> wanted;
+            for(std::size_t channel{}; channel < 3; ++channel) {
+                const auto error{ above[(column + 1) * 3 + channel] + right[channel] };
+                wanted[channel] = std::clamp(channels[channel] + ((error + 8) >> 4), 0, transfer_.max_level);
+            }
+            const rgb_triple color{ transfer_.encode_level(wanted[0]), transfer_.encode_level(wanted[1]),
+                                    transfer_.encode_level(wanted[2]) };
+            const auto index{ matcher_.closest(color) };
+            pack_indices(&index, 1, column, indices, layout_);
+
+            const auto &chosen{ palette_levels_[std::to_integer<std::size_t>(index)] };
+            const std::array<std::int32_t, 3> error{ wanted[0] - chosen[0], wanted[1] - chosen[1], wanted[2] - chosen[2] };
+            for(std::size_t channel{}; channel < 3; ++channel) {
+                right[channel] = error[channel] * 7;
+                below[column * 3 + channel] += error[channel] * 3;
+                below[(column + 1) * 3 + channel] += error[channel] * 5;
+                below[(column + 2) * 3 + channel] += error[channel];
+            }
+            if((column + 1) % constants::progress_interval == 0) {
+                own_progress.store(progress_mark(image_row, column + 1), std::memory_order_release);
+            }
+        }
+        own_progress.store(progress_mark(image_row, layout_.width), std::memory_order_release);
+    }
+
+    const bitmap_layout &layout_;
+    const Matcher &matcher_;
+    const color::transfer &transfer_;
+    // Palette colors in the levels of the transfer, for the errors.
+    std::array<std::array<std::int32_t, 3>, color_table::capacity> palette_levels_{};
+    std::size_t threads_;
+    std::size_t ring_rows_;
+    std::vector<std::int32_t> errors_;
+    std::vector<std::atomic<std::uint64_t>> progress_;
+    std::size_t first_row_{};
+    const std::byte *input_{};
+    std::byte *output_{};
+    std::size_t rows_{};
+    std::atomic<std::size_t> generation_{};
+    std::atomic<std::size_t> finished_{};
+    std::vector<std::jthread> team_;
+};
+
+// Tiled threshold map for ordered dithering, with levels spread evenly over 0..255.
+struct threshold_map {
+    std::size_t width{};
+    std::size_t height{};
+    std::vector<std::uint8_t> levels;
+};
+
+// Bayer matrix of size N x N (N a power of two). Each coordinate bit pair, from the most significant down,
+// adds the 2 x 2 pattern {0, 2; 3, 1} at an increasing weight.
+template<std::size_t N>
+constexpr std::array<std::uint8_t, N * N> bayer_matrix() noexcept {
+    static_assert(std::has_single_bit(N) && N <= 16, "Bayer matrix size must be a power of two up to 16");
+    std::array<std::uint8_t, N * N> matrix{};
+    for(std::size_t y{}; y < N; ++y) {
+        for(std::size_t x{}; x < N; ++x) {
+            std::size_t value{};
+            for(std::size_t bit{ N / 2 }, shift{}; bit != 0; bit /= 2, shift += 2) {
+                const auto x_bit{ (x & bit) != 0 };
+                const auto y_bit{ (y & bit) != 0 };
+                value |= std::size_t{ ((x_bit != y_bit) ? 2U : 0U) | (y_bit ? 1U : 0U) } << shift;
+            }
+            matrix[y * N + x] = static_cast<std::uint8_t>(value * 256 / (N * N));
+        }
+    }
+    return matrix;
+}
+
+template<std::size_t N>
+threshold_map make_bayer_map() {
+    constexpr auto matrix{ bayer_matrix<N>() };
+    return { N, N, { matrix.begin(), matrix.end() } };
+}
+
+// Load a threshold tile (e.g. blue noise) from an 8-bit grayscale or 24-bit BMP.
+std::optional<threshold_map> load_threshold_map(const fs::path &tile_file_path) {
+    std::ifstream tile_file{ tile_file_path, std::ios::binary };
+    bitmap_file_header bmp_file_header{};
+    tile_file.read(reinterpret_cast<char *>(&bmp_file_header), sizeof(bitmap_file_header));
+    bitmap_info_header bmp_info_header{};
+    tile_file.read(reinterpret_cast<char *>(&bmp_info_header), sizeof(bitmap_info_header));
+    if(!tile_file || bmp_file_header.bf_type != constants::BMP_SIGNATURE || bmp_info_header.bi_compression != 0 ||
+       (bmp_info_header.bi_bit_count != 8 && bmp_info_header.bi_bit_count != 24) ||
+       bmp_info_header.bi_width <= 0 || bmp_info_header.bi_width > constants::max_threshold_map_size ||
+       bmp_info_header.bi_height == 0 || std::abs(bmp_info_header.bi_height) > constants::max_threshold_map_size) {
+        std::cerr << "File " << tile_file_path << " is not an 8-bit or 24-bit BMP threshold tile\n";
+        return std::nullopt;
+    }
+
+    // Gray levels of an 8-bit tile come from its color table.
+    std::array<rgb_quad, 256> entries{};
+    if(bmp_info_header.bi_bit_count == 8) {
+        tile_file.seekg(sizeof(bitmap_file_header) + bmp_info_header.bi_size);
+        const auto colors{ bmp_info_header.bi_clr_used == 0 ? 256U : std::min(bmp_info_header.bi_clr_used, 256U) };
+        tile_file.read(reinterpret_cast<char *>(entries.data()), colors * sizeof(rgb_quad));
+    }
+
+    threshold_map map{ static_cast<std::size_t>(bmp_info_header.bi_width),
+                       static_cast<std::size_t>(std::abs(bmp_info_header.bi_height)), {} };
+    const auto bytes_per_pixel{ bmp_info_header.bi_bit_count / 8U };
+    std::vector<std::uint8_t> row((map.width * bmp_info_header.bi_bit_count + 31) / 32 * 4);
+    tile_file.seekg(bmp_file_header.bf_off_bits);
+    for(std::size_t y{}; y < map.height; ++y) {
+        tile_file.read(reinterpret_cast<char *>(row.data()), row.size());
+        for(std::size_t x{}; x < map.width; ++x) {
+            // The green channel stands for the gray level.
+            const auto value{ row[x * bytes_per_pixel + (bytes_per_pixel == 3 ? 1 : 0)] };
+            map.levels.push_back(bytes_per_pixel == 3 ? value : entries[value].green);
+        }
+    }
+    if(!tile_file) {
+        std::cerr << "Unexpected end of threshold tile " << tile_file_path << '\n';
+        return std::nullopt;
+    }
+    return map;
+}
+
+// Ordered dithering: a tiled threshold offset is added to every channel before the palette lookup.
+// Pixels stay independent, so strips convert in any order on any number of threads, and the offset pass is a
+// plain saturating add over the bytes of a row, which compilers vectorize.
+class ordered {
+public:
+    ordered(const bitmap_layout &layout, const threshold_map &map, const color::transfer &transfer)
+        : layout_{ layout }
+        , transfer_{ transfer }
+        , period_{ map.height }
+        , span_{ map.width * std::max<std::size_t>(64 / map.width, 1) }
+        , offsets_(map.height * span_ * 3) {
+        // Expand every tile row to per-channel offsets once, in the levels of the transfer. Rows stay the size of
+        // the tile whatever the image width, repeated up to 64 pixels so that the add runs over more than a few bytes.
+        const auto scale{ (transfer.max_level + 1) / 256 };
+        for(std::size_t y{}; y < map.height; ++y) {
+            for(std::size_t x{}; x < span_; ++x) {
+                const auto level{ std::int32_t{ map.levels[y * map.width + x % map.width] } };
+                const auto offset{ ((2 * level + 1) * constants::ordered_dither_spread / 512 -
+                                    constants::ordered_dither_spread / 2) * scale };
+                std::fill_n(&offsets_[(y * span_ + x) * 3], 3, static_cast<std::int16_t>(offset));
+            }
+        }
+    }
+
+    template<typename Matcher>
+    void convert(const std::byte *input, std::byte *output, std::size_t rows, std::size_t first_row,
+                 const Matcher &matcher) const {
+        std::vector<rgb_triple> dithered(layout_.width);
+        for(std::size_t row{}; row < rows; ++row) {
+            const auto *offsets{ &offsets_[((first_row + row) % period_) * span_ * 3] };
+            for(std::size_t x{}; x < layout_.width; x += span_) {
+                const auto *pixels{ reinterpret_cast<const std::uint8_t *>(input + row * layout_.input_row_size) + x * 3 };
+                auto *channels{ reinterpret_cast<std::uint8_t *>(dithered.data() + x) };
+                const auto count{ std::min(span_, layout_.width - x) * 3 };
+                if(transfer_.max_level == 255) {
+                    for(std::size_t index{}; index < count; ++index) {
+                        channels[index] = static_cast<std::uint8_t>(std::clamp(pixels[index] + offsets[index], 0, 255));
+                    }
+                } else {
+                    for(std::size_t index{}; index < count; ++index) {
+                        channels[index] = transfer_.encode_level(transfer_.decode[pixels[index]] + offsets[index]);
+                    }
+                }
+            }
+            convert_row(dithered.data(), output + row * layout_.output_row_size, layout_, matcher);
+        }
+    }
+
+private:
+    const bitmap_layout &layout_;
+    const color::transfer &transfer_;
+    std::size_t period_;
+    // Width of an offset row in pixels: a whole number of tiles.
+    std::size_t span_;
+    std::vector<std::int16_t> offsets_;
+};
+
+}  // namespace dither
+
+// Dithering applied while mapping pixels to the palette.
+enum class dithering {
+    none,
+    floyd_steinberg,
+    ordered,
+};
+
+// Algorithm of adaptive palettes.
+enum class quantizer {
+    median_cut,
+    octree,
+};
+
+// Rotation (clockwise, as displayed) or flip of the converted image.
+enum class orientation {
+    none,
+    rotate_90,
+    rotate_180,
+    rotate_270,
+    flip_horizontal,
+    flip_vertical,
+};
+
+namespace orient {
+
+// Side of the square tiles output pixels are gathered in: the source pixels of a tile span as many rows, whose
+// cache lines and pages stay resident while the tile is filled.
+static constexpr std::size_t tile{ 64 };
+
+constexpr bool transposes(orientation orientation) noexcept {
+    return orientation == orientation::rotate_90 || orientation == orientation::rotate_270;
+}
+
+// Layout of the converted image once oriented. Rows padded to another width may no longer fit a BMP.
+std::optional<bitmap_layout> make_layout(const bitmap_layout &source, orientation orientation,
+                                         const fs::path &input_file_path) {
+    auto layout{ source };
+    if(transposes(orientation)) {
+        std::swap(layout.width, layout.height);
+        std::swap(layout.info_header.bi_x_pels_per_meter, layout.info_header.bi_y_pels_per_meter);
+        layout.info_header.bi_width = static_cast<std::int32_t>(layout.width);
+        layout.info_header.bi_height = static_cast<std::int32_t>(layout.height) * (source.info_header.bi_height > 0 ? 1 : -1);
+        if(!set_palette(layout, layout.palette, input_file_path)) {
+            return std::nullopt;
+        }
+    }
+    return layout;
+}
+
+// Hand the packed rows of `image` oriented to `emit(band, bytes)`, one band of `tile` output rows at a time. Every tile of a band comes from
+// a square of at most `tile` by `tile` source pixels: its source rows are unpacked into a block of indices a whole
+// byte at a time, and the block is read back transposed or mirrored and packed into the band. Rows are handled as
+// stored: a bottom-up image is upside down, which turns rotations the other way round.
+template<std::size_t Bits, typename Emit>
+void write_bands(std::span<const std::byte> image, const bitmap_layout &from, const bitmap_layout &to,
+                 orientation orientation, Emit &&emit) {
+    if(from.info_header.bi_height > 0 && transposes(orientation)) {
+        orientation = orientation == orientation::rotate_90 ? orientation::rotate_270 : orientation::rotate_90;
+    }
+    // Source column and row of an output pixel.
+    const auto source{ [&](std::size_t column, std::size_t row) -> std::pair<std::size_t, std::size_t> {
+        switch(orientation) {
+        case orientation::rotate_90:
+            return { row, from.height - 1 - column };
+        case orientation::rotate_270:
+            return { from.width - 1 - row, column };
+        case orientation::rotate_180:
+            return { from.width - 1 - column, from.height - 1 - row };
+        case orientation::flip_horizontal:
+            return { from.width - 1 - column, row };
+        default:
+            return { column, from.height - 1 - row };
+        }
+    } };
+    std::vector<std::byte> band(tile * to.output_row_size);
+    std::array<std::array<std::byte, tile>, tile> block;
+    std::array<std::byte, tile> indices;
+    for(std::size_t first_row{}; first_row < to.height; first_row += tile) {
+        const auto rows{ std::min(tile, to.height - first_row) };
+        std::ranges::fill(band, std::byte{});
+        for(std::size_t first_column{}; first_column < to.width; first_column += tile) {
+            const auto columns{ std::min(tile, to.width - first_column) };
+            const auto [x_first, y_first]{ source(first_column, first_row) };
+            const auto [x_last, y_last]{ source(first_column + columns - 1, first_row + rows - 1) };
+            const auto x0{ std::min(x_first, x_last) };
+            const auto y0{ std::min(y_first, y_last) };
+            for(auto y{ y0 }; y <= std::max(y_first, y_last); ++y) {
+                unpack_indices<Bits>(image.data() + y * from.output_row_size, x0, std::max(x_first, x_last) - x0 + 1,
+                                     block[y - y0].data());
+            }
+            for(std::size_t row{}; row < rows; ++row) {
+                for(std::size_t column{}; column < columns; ++column) {
+                    const auto [x, y]{ source(first_column + column, first_row + row) };
+                    indices[column] = block[y - y0][x - x0];
+                }
+                pack_indices<Bits>(indices.data(), columns, first_column, band.data() + row * to.output_row_size);
+            }
+        }
+        emit(band.data(), rows * to.output_row_size);
+    }
+}
+
+template<typename Emit>
+void write_bands(std::span<const std::byte> image, const bitmap_layout &from, const bitmap_layout &to,
+                 orientation orientation, Emit &&emit) {
+    switch(from.info_header.bi_bit_count) {
+    case 1:
+        return write_bands<1>(image, from, to, orientation, emit);
+    case 8:
+        return write_bands<8>(image, from, to, orientation, emit);
+    default:
+        return write_bands<4>(image, from, to, orientation, emit);
+    }
+}
+
+inline bool write(std::span<const std::byte> image, const bitmap_layout &from, const bitmap_layout &to,
+                  orientation orientation, std::ostream &output) {
+    write_bands(image, from, to, orientation, [&output](const std::byte *band, std::size_t bytes) {
+        output.write(reinterpret_cast<const char *>(band), static_cast<std::streamsize>(bytes));
+    });
+    return static_cast<bool>(output);
+}
+
+// Orient the packed rows of `image` into `output`, which holds the rows of the oriented image.
+inline void write(std::span<const std::byte> image, const bitmap_layout &from, const bitmap_layout &to,
+                  orientation orientation, std::byte *output) {
+    write_bands(image, from, to, orientation, [&output](const std::byte *band, std::size_t bytes) {
+        output = std::copy_n(band, bytes, output);
+    });
+}
+
+}  // namespace orient
+
+namespace indexed {
+
+// Headers, geometry and color table of an indexed (1, 4 or 8-bit) BMP image, such as a converted one.
+struct image {
+    bitmap_file_header file_header;
+    bitmap_info_header info_header;
+    std::size_t width;
+    std::size_t height;
+    std::size_t row_size;
+    color_table palette;
+};
+
+// Read the headers and the color table of an indexed BMP image, leaving the stream at its pixels.
+std::optional<image> read(std::istream &input, const fs::path &input_file_path) {
+    image image{};
+    input.read(reinterpret_cast<char *>(&image.file_header), sizeof(bitmap_file_header));
+    input.read(reinterpret_cast<char *>(&image.info_header), sizeof(bitmap_info_header));
+    const auto &info{ image.info_header };
+    if(!input || image.file_header.bf_type != constants::BMP_SIGNATURE || info.bi_compression != 0 ||
+       (info.bi_bit_count != 1 && info.bi_bit_count != 4 && info.bi_bit_count != 8) || info.bi_width <= 0 ||
+       info.bi_height == 0 || info.bi_size < sizeof(bitmap_info_header)) {
+        std::cerr << "File " << input_file_path << " is not an uncompressed 1, 4 or 8-bit BMP file\n";
+        return std::nullopt;
+    }
+    image.width = static_cast<std::size_t>(info.bi_width);
+    image.height = static_cast<std::size_t>(std::abs(static_cast<std::int64_t>(info.bi_height)));
+    image.row_size = (image.width * info.bi_bit_count + 31) / 32 * 4;
+    const auto entries{ std::size_t{ 1 } << info.bi_bit_count };
+    image.palette = color_table{ info.bi_clr_used == 0 ? entries : std::min<std::size_t>(info.bi_clr_used, entries) };
+    input.ignore(info.bi_size - sizeof(bitmap_info_header));
+    input.read(reinterpret_cast<char *>(image.palette.data()),
+               static_cast<std::streamsize>(image.palette.size() * sizeof(rgb_quad)));
+    const auto headers_size{ sizeof(bitmap_file_header) + info.bi_size + image.palette.size() * sizeof(rgb_quad) };
+    if(!input || image.file_header.bf_off_bits < headers_size || image.row_size > constants::max_row_size) {
+        std::cerr << "File " << input_file_path << " is malformed\n";
+        return std::nullopt;
+    }
+    input.ignore(static_cast<std::streamsize>(image.file_header.bf_off_bits - headers_size));
+    return image;
+}
+
+// Colors of the 16 entries of a 4-bit color table, channel by channel (blue, green, red, reserved): the tables
+// of byte shuffles.
+using channel_tables = std::array<std::array<std::uint8_t, 16>, 4>;
+
+#ifdef SETM_BMP_AVX2
+
+// Expand 4-bit pixels 32 at a time: the nibbles of 16 bytes become indices, and one byte shuffle per channel looks
+// up all 32 pixels in the 16 colors. Returns the number of pixels expanded; the caller expands the rest.
+template<std::size_t Bytes>
+__attribute__((target("avx2"))) std::size_t expand_nibbles(const std::byte *row, std::size_t count,
+                                                           const channel_tables &tables, std::byte *pixels) noexcept {
+    __m256i channels[4];
+    for(std::size_t channel{}; channel < tables.size(); ++channel) {
+        channels[channel] =
+            _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(tables[channel].data())));
+    }
+    const auto low_nibbles{ _mm_set1_epi8(0x0F) };
+    // Moves the blue, green and red bytes of four 32-bit pixels to the low 12 bytes of each half.
+    const auto drop_reserved{ _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                               0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1) };
+    // A 24-bit group stores 4 bytes past its end, overwritten by the next two pixels.
+    constexpr std::size_t slack{ Bytes == 3 ? 2 : 0 };
+    std::size_t done{};
+    for(; done + 32 + slack <= count; done += 32) {
+        const auto packed{ _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + done / 2)) };
+        const auto high{ _mm_and_si128(_mm_srli_epi16(packed, 4), low_nibbles) };
+        const auto low{ _mm_and_si128(packed, low_nibbles) };
+        // Pixels 0-15 in the low half, 16-31 in the high one.
+        const auto indices{ _mm256_set_m128i(_mm_unpackhi_epi8(high, low), _mm_unpacklo_epi8(high, low)) };
+        const auto b{ _mm256_shuffle_epi8(channels[0], indices) };
+        const auto g{ _mm256_shuffle_epi8(channels[1], indices) };
+        const auto r{ _mm256_shuffle_epi8(channels[2], indices) };
+        const auto a{ _mm256_shuffle_epi8(channels[3], indices) };
+        const auto bg_low{ _mm256_unpacklo_epi8(b, g) };
+        const auto bg_high{ _mm256_unpackhi_epi8(b, g) };
+        const auto ra_low{ _mm256_unpacklo_epi8(r, a) };
+        const auto ra_high{ _mm256_unpackhi_epi8(r, a) };
+        // Pixels 0-3 and 16-19, 4-7 and 20-23, 8-11 and 24-27, 12-15 and 28-31.
+        const auto first{ _mm256_unpacklo_epi16(bg_low, ra_low) };
+        const auto second{ _mm256_unpackhi_epi16(bg_low, ra_low) };
+        const auto third{ _mm256_unpacklo_epi16(bg_high, ra_high) };
+        const auto fourth{ _mm256_unpackhi_epi16(bg_high, ra_high) };
+        const __m256i quads[]{ _mm256_permute2x128_si256(first, second, 0x20),
+                               _mm256_permute2x128_si256(third, fourth, 0x20),
+                               _mm256_permute2x128_si256(first, second, 0x31),
+                               _mm256_permute2x128_si256(third, fourth, 0x31) };
+        auto *destination{ pixels + done * Bytes };
+        for(const auto &quad : quads) {
+            if constexpr(Bytes == 4) {
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(destination), quad);
+            } else {
+                const auto triples{ _mm256_shuffle_epi8(quad, drop_reserved) };
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(destination), _mm256_castsi256_si128(triples));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(destination + 12), _mm256_extracti128_si256(triples, 1));
+            }
+            destination += 8 * Bytes;
+        }
+    }
+    return done;
+}
+
+#endif
+
+// Expands packed rows to 24-bit (blue, green, red) or 32-bit (plus the reserved byte) pixels through the color
+// table. 4-bit rows take byte shuffles where the processor has AVX2, and otherwise a table of the colors of both
+// pixels of every byte.
+class expander {
+public:
+    expander(const image &image, std::size_t bytes_per_pixel)
+        : width_{ image.width }
+        , bits_{ image.info_header.bi_bit_count }
+        , bytes_{ bytes_per_pixel } {
+        std::copy(image.palette.begin(), image.palette.end(), colors_.begin());
+        for(std::size_t byte{}; byte < pairs_.size(); ++byte) {
+            std::memcpy(pairs_[byte].data(), &colors_[byte >> 4], bytes_);
+            std::memcpy(pairs_[byte].data() + bytes_, &colors_[byte & 0x0F], bytes_);
+        }
+        for(std::size_t index{}; index < 16; ++index) {
+            channels_[0][index] = colors_[index].blue;
+            channels_[1][index] = colors_[index].green;
+            channels_[2][index] = colors_[index].red;
+            channels_[3][index] = colors_[index].reserved;
+        }
+    }
+
+    void expand(const std::byte *row, std::byte *pixels) const noexcept {
+        if(bytes_ == 3) {
+            expand<3>(row, pixels);
+        } else {
+            expand<4>(row, pixels);
+        }
+    }
+
+private:
+    template<std::size_t Bytes>
+    void expand(const std::byte *row, std::byte *pixels) const noexcept {
+        std::size_t column{};
+        if(bits_ == 4) {
+#ifdef SETM_BMP_AVX2
+            static const bool avx2{ __builtin_cpu_supports("avx2") != 0 };
+            if(avx2) {
+                column = expand_nibbles<Bytes>(row, width_, channels_, pixels);
+            }
+#endif
+            for(; column + 2 <= width_; column += 2) {
+                std::memcpy(pixels + column * Bytes, pairs_[std::to_integer<std::size_t>(row[column / 2])].data(), 2 * Bytes);
+            }
+        }
+        for(; column < width_; ++column) {
+            const auto index{ std::to_integer<std::size_t>(bits_ == 1 ? packed_index<1>(row, column)
+                                                           : bits_ == 4 ? packed_index<4>(row, column)
+                                                                        : row[column]) };
+            std::memcpy(pixels + column * Bytes, &colors_[index], Bytes);
+        }
+    }
+
+    std::array<rgb_quad, 256> colors_{};
+    // Colors of both pixels of every byte of a 4-bit row.
+    std::array<std::array<std::byte, 8>, 256> pairs_{};
+    channel_tables channels_{};
+    std::size_t width_;
+    std::size_t bits_;
+    std::size_t bytes_;
+};
+
+#ifdef SETM_BMP_AVX2
+
+// Remap 4-bit pixels 64 at a time: each nibble of 32 bytes is looked up in its 16-entry table by a byte shuffle,
+// the high nibbles in a table of the new indices shifted into place. Returns the number of bytes remapped.
+__attribute__((target("avx2"))) inline std::size_t remap_nibbles(const std::byte *row, std::size_t count,
+                                                                 const std::array<std::uint8_t, 16> &low_map,
+                                                                 const std::array<std::uint8_t, 16> &high_map,
+                                                                 std::byte *remapped) noexcept {
+    const auto low_table{ _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(low_map.data()))) };
+    const auto high_table{ _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(high_map.data()))) };
+    const auto low_nibbles{ _mm256_set1_epi8(0x0F) };
+    std::size_t done{};
+    for(; done + 32 <= count; done += 32) {
+        const auto packed{ _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + done)) };
+        const auto high{ _mm256_and_si256(_mm256_srli_epi16(packed, 4), low_nibbles) };
+        const auto low{ _mm256_and_si256(packed, low_nibbles) };
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(remapped + done),
+                            _mm256_or_si256(_mm256_shuffle_epi8(high_table, high), _mm256_shuffle_epi8(low_table, low)));
+    }
+    return done;
+}
+
+#endif
+
+// Rewrites packed rows for another color table without decoding them. Every index of the old table maps to the
+// index of its closest color in the new one, searched once per entry; rows then go through a table of the remapped
+// value of every byte, whatever the bit depth. 4-bit rows take nibble shuffles where the processor has AVX2.
+class remapper {
+public:
+    remapper(const image &image, const color_table &palette, color::metric metric)
+        : bits_{ image.info_header.bi_bit_count }
+        , pixel_bytes_{ (image.width * bits_ + 7) / 8 } {
+        const auto entries{ std::size_t{ 1 } << bits_ };
+        std::array<std::uint8_t, 256> indices{};
+        color::with_metric(metric, [&]<typename Metric>(Metric) {
+            const color::palette_matcher<Metric> matcher{ palette, nullptr };
+            for(std::size_t index{}; index < entries; ++index) {
+                // Indices past the old table stand for black, as they do when expanded.
+                const auto &color{ image.palette[index] };
+                indices[index] = std::to_integer<std::uint8_t>(matcher.closest({ color.blue, color.green, color.red }));
+            }
+            return 0;
+        });
+        const auto per_byte{ 8 / bits_ };
+        const auto mask{ static_cast<unsigned>(entries - 1) };
+        for(unsigned byte{}; byte < bytes_.size(); ++byte) {
+            unsigned remapped{};
+            for(std::size_t pixel{}; pixel < per_byte; ++pixel) {
+                const auto shift{ pixel * bits_ };
+                remapped |= unsigned{ indices[(byte >> shift) & mask] } << shift;
+            }
+            bytes_[byte] = static_cast<std::uint8_t>(remapped);
+        }
+        for(std::size_t index{}; index < 16; ++index) {
+            low_nibbles_[index] = indices[index];
+            high_nibbles_[index] = static_cast<std::uint8_t>(indices[index] << 4);
+        }
+        // Bits of the last byte past the last pixel stay clear.
+        const auto used_bits{ image.width * bits_ % 8 };
+        last_mask_ = used_bits == 0 ? std::byte{ 0xFF } : std::byte(0xFF << (8 - used_bits));
+    }
+
+    void remap(const std::byte *row, std::byte *remapped) const noexcept {
+        std::size_t byte{};
+#ifdef SETM_BMP_AVX2
+        static const bool avx2{ __builtin_cpu_supports("avx2") != 0 };
+        if(bits_ == 4 && avx2) {
+            byte = remap_nibbles(row, pixel_bytes_, low_nibbles_, high_nibbles_, remapped);
+        }
+#endif
+        for(; byte < pixel_bytes_; ++byte) {
+            remapped[byte] = std::byte{ bytes_[std::to_integer<std::size_t>(row[byte])] };
+        }
+        remapped[pixel_bytes_ - 1] &= last_mask_;
+    }
+
+private:
+    std::size_t bits_;
+    std::size_t pixel_bytes_;
+    std::array<std::uint8_t, 256> bytes_{};
+    std::array<std::uint8_t, 16> low_nibbles_{};
+    std::array<std::uint8_t, 16> high_nibbles_{};
+    std::byte last_mask_{ 0xFF };
+};
+
+}  // namespace indexed
+
+// Conversion settings taken from the command line.
+struct options {
+    // Use io_uring for file I/O where the kernel provides it.
+    bool io_uring{ true };
+    // Ceiling for the pixel buffers, in bytes.
+    std::size_t memory_budget{ constants::memory_budget };
+    // Report the peak resident set size when done.
+    bool report_memory{};
+    dithering dithering_mode{ dithering::none };
+    color::metric color_metric{ color::metric::rgb };
+    // Quantize and dither in linear light rather than on sRGB values.
+    bool linear_light{};
+    // Threshold tile of ordered dithering.
+    dither::threshold_map threshold_map;
+    // Derive the palette from the image by median cut instead of using the fixed one.
+    bool adaptive_palette{};
+    quantizer palette_quantizer{ quantizer::median_cut };
+    // Refine the palette by k-means over the image colors.
+    bool refine_palette{};
+    quantize::refinement refinement;
+    // Percentage of the rows the adaptive palette is estimated from, 0 for all of them.
+    double palette_sample{};
+    // Report the palette error estimated on a sample.
+    bool report_palette{};
+    // Palette to convert with as is, instead of the fixed or a derived one.
+    std::optional<color_table> palette;
+    // Fill the lookup table over all 24-bit colors before converting, whatever the image size.
+    bool full_lookup_table{};
+    // Keep complete lookup tables in this directory, and map them from there on later runs.
+    std::optional<fs::path> lookup_table_cache;
+    // Batch mode derives one palette for all inputs, persisted in this file.
+    std::optional<fs::path> shared_palette;
+    // Rotate or flip the converted image.
+    orientation output_orientation{ orientation::none };
+};
+
+// Linear light measures the default Euclidean distance on linear values too.
+color::metric effective_metric(const options &options) noexcept {
+    return options.linear_light && options.color_metric == color::metric::rgb ? color::metric::linear : options.color_metric;
+}
+
+// Whether the conversion takes a first pass over the pixels to derive its palette.
+bool derives_palette(const options &options) noexcept {
+    return !options.palette && (options.adaptive_palette || options.refine_palette);
+}
+
+// Palette of an image with the given color statistics and, for the octree quantizer, octree. An adaptive palette
+// of an image with few enough colors is just those colors.
+color_table make_palette(const quantize::statistics &statistics, const quantize::octree &octree, const options &options) {
+    color_table palette{ constants::palette };
+    if(options.adaptive_palette) {
+        if(const auto exact{ statistics.colors.exact_palette() }) {
+            return *exact;
+        }
+        palette = options.palette_quantizer == quantizer::octree ? octree.palette() : quantize::median_cut(statistics.binned);
+    }
+    return options.refine_palette ? quantize::refine(statistics.binned, palette, options.refinement) : palette;
+}
+
+// Pixel samples of an input file: one for the palette search, if the options ask for it, and an independent one
+// to estimate palette errors on.
+struct pixel_samples {
+    std::vector<rgb_triple> palette;
+    std::vector<rgb_triple> holdout;
+};
+
+// Samples the pixels of an input file through a memory mapping, so that only the sampled rows are read.
+// Gives nothing where files cannot be mapped.
+std::optional<pixel_samples> sample_file(const fs::path &input_file_path, const bitmap_layout &layout,
+                                         const options &options) {
+#ifdef SETM_BMP_MMAP
+    const io::mapped_file file{ input_file_path };
+    if(!file || file.bytes().size() < layout.input_pixel_offset + std::uint64_t{ layout.input_row_size } * layout.height) {
+        return std::nullopt;
+    }
+    const auto pixels{ file.bytes().subspan(layout.input_pixel_offset) };
+    pixel_samples samples;
+    if(options.palette_sample > 0) {
+        samples.palette = quantize::sample_pixels(pixels, layout, options.palette_sample, options.refinement.seed);
+    }
+    if(options.report_palette) {
+        samples.holdout = quantize::sample_pixels(pixels, layout, constants::holdout_sample_percent, options.refinement.seed + 1);
+    }
+    return samples;
+#else
+    return std::nullopt;
+#endif
+}
+
+// Reads the headers of a 24-bit BMP and skips to its pixels. Whatever lies between the headers and the pixels
+// (larger info headers, color masks) is skipped without seeking, so that pipes work too.
+std::optional<bitmap_layout> read_layout(std::istream &input, const fs::path &input_file_path, const color_table &palette) {
+    bitmap_file_header bmp_file_header{};
+    input.read(reinterpret_cast<char *>(&bmp_file_header), sizeof(bitmap_file_header));
+    bitmap_info_header bmp_info_header{};
+    input.read(reinterpret_cast<char *>(&bmp_info_header), sizeof(bitmap_info_header));
+    if(!input) {
+        std::cerr << "File " << input_file_path << " is not a BMP file\n";
+        return std::nullopt;
+    }
+    auto layout{ make_layout(bmp_file_header, bmp_info_header, input_file_path, palette) };
+    if(layout) {
+        input.ignore(static_cast<std::streamsize>(layout->input_pixel_offset - constants::input_headers_size));
+    }
+    return layout;
+}
+
+// Hands the pixel rows to the pipeline workers, each adding them to its own copy of the empty result, and merges
+// the copies into the result. The first worker adds to the result itself. The copies of the others are charged to
+// the memory budget along with the strips, so workers are dropped until at least a row per strip fits beside them.
+template<typename Partial>
+bool scan_partials(std::istream &input, const bitmap_layout &layout, std::size_t memory_budget, std::size_t threads,
+                   Partial &result) {
+    const auto partial_size{ result.memory_size() };
+    const auto workers{ std::clamp<std::size_t>((memory_budget + partial_size) /
+                                                    (partial_size + constants::strips_per_worker * layout.input_row_size),
+                                                1, std::max<std::size_t>(threads, 1)) };
+    const auto plan{ pipeline::make_plan(layout.input_row_size, 0, workers,
+                                         memory_budget - std::min(memory_budget, (workers - 1) * partial_size)) };
+    std::vector<Partial> partials(plan.workers - 1, result);
+    io::stream_source source{ input, layout.input_row_size };
+    io::null_sink sink;
+    pipeline::run(layout.height, plan, layout.input_row_size, 0, source,
+                  [&](pipeline::strip &strip) {
+                      const auto worker{ strip.sequence % plan.workers };
+                      (worker == 0 ? result : partials[worker - 1]).add_rows(strip.input.data(), strip.rows, layout);
+                  },
+                  sink);
+    for(const auto &partial : partials) {
+        result.merge(partial);
+    }
+    return !source.failed();
+}
+
+// Reads the pixel rows of an image strip by strip and hands them in order to the consumer.
+template<typename Consume>
+bool scan_rows(std::istream &input, const bitmap_layout &layout, std::size_t memory_budget, Consume &&consume) {
+    const auto plan{ pipeline::make_plan(layout.input_row_size, 0, 1, memory_budget) };
+    std::vector<std::byte> buffer(plan.strip_rows * layout.input_row_size);
+    for(std::size_t row{}; row < layout.height; row += plan.strip_rows) {
+        const auto rows{ std::min<std::size_t>(plan.strip_rows, layout.height - row) };
+        input.read(reinterpret_cast<char *>(buffer.data()), static_cast<std::streamsize>(rows * layout.input_row_size));
+        if(!input) {
+            return false;
+        }
+        consume(buffer.data(), rows);
+    }
+    return true;
+}
+
+// File in the temporary directory, removed with the object. Where POSIX allows, it is created by mkstemp: under an
+// unpredictable name, exclusively and readable by its owner only, and kept open while it exists.
+class temporary_file {
+public:
+    temporary_file() {
+        std::error_code error;
+        const auto directory{ fs::temp_directory_path(error) };
+#ifdef SETM_BMP_MMAP
+        auto name{ (directory / "setm-bmp-XXXXXX").string() };
+        fd_ = io::file_descriptor{ ::mkstemp(name.data()) };
+        if(fd_) {
+            path_ = name;
+        }
+#else
+        path_ = directory / ("setm-bmp-" + std::to_string(std::random_device{}()));
+#endif
+    }
+    temporary_file(const temporary_file &) = delete;
+    temporary_file &operator=(const temporary_file &) = delete;
+    ~temporary_file() {
+        std::error_code error;
+        if(!path_.empty()) {
+            fs::remove(path_, error);
+        }
+    }
+
+    // Empty if the file could not be created.
+    const fs::path &path() const noexcept { return path_; }
+
+private:
+    fs::path path_;
+#ifdef SETM_BMP_MMAP
+    io::file_descriptor fd_;
+#endif
+};
+
+// Complete lookup tables kept on disk, one file per palette and metric, so that short-lived processes map a table
+// instead of building it. A file is a header then the 2^24 palette indices. The header repeats the palette and
+// metric the file name is a hash of, and holds a checksum of the indices, verified on every load. Files are
+// written under a temporary name and renamed, so that concurrent runs never see a partial file.
+namespace lookup_cache {
+
+constexpr std::array<char, 8> magic{ 'S', 'E', 'T', 'M', 'L', 'U', 'T', '\0' };
+// Bumped whenever the layout or the metrics change.
+constexpr std::uint32_t version{ 1 };
+constexpr std::size_t entries{ std::size_t{ 1 } << 24 };
+
+struct header {
+    std::array<char, 8> magic;
+    std::uint32_t version;
+    std::uint32_t metric;
+    std::uint32_t colors;
+    std::uint32_t reserved;
+    std::array<rgb_quad, color_table::capacity> palette;
+    std::uint64_t checksum;
+};
+static_assert(std::has_unique_object_representations_v<header>);
+
+header make_header(const color_table &palette, color::metric metric) noexcept {
+    header header{ magic, version, static_cast<std::uint32_t>(metric), static_cast<std::uint32_t>(palette.size()), 0, {}, 0 };
+    std::copy(palette.begin(), palette.end(), header.palette.begin());
+    return header;
+}
+
+std::uint64_t checksum(const std::uint8_t *table) noexcept {
+    return utils::hash({ reinterpret_cast<const std::byte *>(table), entries });
+}
+
+// `<directory>/<hash of the header>.lut`, the header without its checksum.
+fs::path file_path(const fs::path &directory, const header &header) {
+    const auto key{ utils::hash({ reinterpret_cast<const std::byte *>(&header), offsetof(struct header, checksum) }) };
+    std::array<char, 16> digits;
+    auto *end{ std::to_chars(digits.data(), digits.data() + digits.size(), key, 16).ptr };
+    std::string name(static_cast<std::size_t>(digits.data() + digits.size() - end), '0');
+    return directory / name.append(digits.data(), end).append(".lut");
+}
+
+// The table of a valid cache file, and what keeps it alive.
+struct table {
+    const std::uint8_t *entries;
+    std::shared_ptr<const void> owner;
+};
+
+std::optional<table> load(const fs::path &path, const header &expected) {
+    const auto valid{ [&](std::span<const std::byte> bytes) {
+        header stored;
+        if(bytes.size() != sizeof(header) + entries) {
+            return false;
+        }
+        std::memcpy(&stored, bytes.data(), sizeof(header));
+        const auto *indices{ reinterpret_cast<const std::uint8_t *>(bytes.data() + sizeof(header)) };
+        return std::memcmp(&stored, &expected, offsetof(header, checksum)) == 0 && stored.checksum == checksum(indices);
+    } };
+#ifdef SETM_BMP_MMAP
+    auto file{ std::make_shared<const io::mapped_file>(path) };
+    if(!*file || !valid(file->bytes())) {
+        return std::nullopt;
+    }
+    return table{ reinterpret_cast<const std::uint8_t *>(file->bytes().data() + sizeof(header)), file };
+#else
+    std::ifstream file{ path, std::ios::binary };
+    auto bytes{ std::make_shared<std::vector<std::byte>>(sizeof(header) + entries + 1) };
+    file.read(reinterpret_cast<char *>(bytes->data()), static_cast<std::streamsize>(bytes->size()));
+    bytes->resize(static_cast<std::size_t>(file.gcount()));
+    if(!valid(*bytes)) {
+        return std::nullopt;
+    }
+    return table{ reinterpret_cast<const std::uint8_t *>(bytes->data() + sizeof(header)), bytes };
+#endif
+}
+
+bool save(const fs::path &path, header header, const std::uint8_t *table) {
+    std::error_code error;
+    fs::create_directories(path.parent_path(), error);
+    header.checksum = checksum(table);
+    auto temporary{ path };
+    temporary += "." + std::to_string(std::random_device{}()) + ".tmp";
+    {
+        std::ofstream file{ temporary, std::ios::binary };
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char *>(table), entries);
+        if(!file.flush()) {
+            fs::remove(temporary, error);
+            return false;
+        }
+    }
+    fs::rename(temporary, path, error);
+    if(error) {
+        fs::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace lookup_cache
+
+// Converts strips of rows with the palette, metric and dithering of the options, the metric fixed at compile time.
+template<typename Metric>
+class metric_converter {
+public:
+    metric_converter(const bitmap_layout &layout, const options &options, std::size_t threads,
+                     color::lookup_tables &tables)
+        : layout_{ layout }
+        , matcher_{ layout.palette, acquire_lookup_table(layout, options, tables) } {
+        prepare_lookup_table(options);
+        const auto &transfer{ options.linear_light ? color::transfer::linear() : color::transfer::srgb() };
+        if(options.dithering_mode == dithering::floyd_steinberg) {
+            diffusion_.emplace(layout, matcher_, transfer, threads);
+        } else if(options.dithering_mode == dithering::ordered) {
+            ordered_.emplace(layout, options.threshold_map, transfer);
+        }
+    }
+
+    // Error diffusion carries state from row to row: strips must then be converted in image order, by one caller.
+    bool sequential() const noexcept { return diffusion_.has_value(); }
+
+    void convert(const std::byte *input, std::byte *output, std::size_t rows, std::size_t first_row) {
+        if(diffusion_) {
+            diffusion_->convert(input, output, rows);
+        } else if(ordered_) {
+            ordered_->convert(input, output, rows, first_row, matcher_);
+        } else {
+            convert_rows(input, output, rows, layout_, matcher_);
+        }
+    }
+
+private:
+    // The lookup table of a large image, or a complete one if asked for, when it fits the budget.
+    static std::shared_ptr<color::lookup_table> acquire_lookup_table(const bitmap_layout &layout, const options &options,
+                                                                     color::lookup_tables &tables) {
+        const bool complete{ options.lookup_table_cache || options.full_lookup_table };
+        if(!complete && std::uint64_t{ layout.width } * layout.height < constants::lookup_table_pixels) {
+            return nullptr;
+        }
+        auto table{ tables.acquire(layout.palette, effective_metric(options), !complete) };
+        if(!table && complete) {
+            std::cerr << "The lookup table does not fit in half the memory budget, searching the palette instead\n";
+        }
+        return table;
+    }
+
+    // Builds the complete lookup table if asked for, or maps it from the cache, building and storing it on a miss.
+    void prepare_lookup_table(const options &options) {
+        if(!matcher_.has_table()) {
+            return;
+        }
+        std::optional<lookup_cache::header> header;
+        fs::path cache_file_path;
+        if(options.lookup_table_cache) {
+            header = lookup_cache::make_header(layout_.palette, effective_metric(options));
+            cache_file_path = lookup_cache::file_path(*options.lookup_table_cache, *header);
+            if(auto table{ lookup_cache::load(cache_file_path, *header) }) {
+                matcher_.adopt(table->entries, std::move(table->owner));
+                return;
+            }
+        } else if(!options.full_lookup_table) {
+            return;
+        }
+        const auto start{ std::chrono::steady_clock::now() };
+        if(!matcher_.build(std::max(std::thread::hardware_concurrency(), 1U))) {
+            return;
+        }
+        const std::chrono::duration<double, std::milli> elapsed{ std::chrono::steady_clock::now() - start };
+        std::cerr << "Lookup table built in " << elapsed.count() << " ms\n";
+        if(header && !lookup_cache::save(cache_file_path, *header, matcher_.table())) {
+            std::cerr << "Failed to write lookup table cache file " << cache_file_path << '\n';
+        }
+    }
+
+    const bitmap_layout &layout_;
+    color::palette_matcher<Metric> matcher_;
+    std::optional<dither::floyd_steinberg<color::palette_matcher<Metric>>> diffusion_;
+    std::optional<dither::ordered> ordered_;
+};
+
+// Converts strips of rows with the options, dispatching to the converter of their metric once per strip.
+class converter {
+public:
+    converter(const bitmap_layout &layout, const options &options, std::size_t threads, color::lookup_tables &tables)
+        : conversion_{ color::with_metric(effective_metric(options), [&]<typename Metric>(Metric) {
+            return conversion{ std::in_place_type<metric_converter<Metric>>, layout, options, threads, tables };
+        }) } {}
+
+    bool sequential() const noexcept {
+        return std::visit([](const auto &conversion) { return conversion.sequential(); }, conversion_);
+    }
+
+    void convert(const std::byte *input, std::byte *output, std::size_t rows, std::size_t first_row) {
+        std::visit([&](auto &conversion) { conversion.convert(input, output, rows, first_row); }, conversion_);
+    }
+
+private:
+    using conversion = std::variant<metric_converter<color::squared_rgb>, metric_converter<color::redmean>,
+                                    metric_converter<color::luma_weighted>, metric_converter<color::oklab>,
+                                    metric_converter<color::cie76>, metric_converter<color::cie94>,
+                                    metric_converter<color::linear_rgb>>;
+
+    conversion conversion_;
+};
+
+// Peak resident set size of the process in KiB, where the platform reports it.
+std::optional<std::uint64_t> peak_resident_set_kib() noexcept {
+#if __has_include(<sys/resource.h>)
+    rusage usage{};
+    if(::getrusage(RUSAGE_SELF, &usage) == 0) {
+        return static_cast<std::uint64_t>(usage.ru_maxrss);
+    }
+#endif
+    return std::nullopt;
+}
+
+// Convert a 24-bit BMP image to a 4-bit (or, with a built-in palette of another size, 1- or 8-bit) one.
+bool convert_bmp_24_to_4_depth(const fs::path &input_file_path,
+                               const fs::path &output_file_path,
+                               const options &options = {}) {
+    // Open input BMP file, or stream it from stdin.
+    const bool from_stdin{ input_file_path == constants::standard_stream };
+    std::ifstream input_file;
+    if(!from_stdin) {
+        input_file.open(input_file_path, std::ios::binary);
+        if(!input_file) {
+            std::cerr << "Failed to open input file" << input_file_path << '\n';
+            return false;
+        }
+    }
+    auto &input{ from_stdin ? std::cin : static_cast<std::istream &>(input_file) };
+
+    // Read BMP headers. The output headers follow from them alone, so they are written before any pixel is read.
+    auto layout{ read_layout(input, input_file_path, options.palette.value_or(constants::palette)) };
+    if(!layout) {
+        return false;
+    }
+    const auto threads{ std::max(std::thread::hardware_concurrency(), 1U) };
+
+    // An adaptive or refined palette takes a first pass over the pixels. For the median cut, every pipeline
+    // worker gathers its own color statistics, and the partial statistics are merged. The octree takes the pixels in
+    // order, and so does a pass over stdin, which also spools the pixels to a temporary file for the second pass.
+    // A sampled palette reads only the sampled rows of the mapped file, and skips the full pass unless its error
+    // is reported against the palette of the full image.
+    std::istream *pixels{ &input };
+    std::optional<temporary_file> spool_file;
+    std::fstream spool;
+    std::optional<pixel_samples> samples;
+    if(derives_palette(options) && (options.palette_sample > 0 || options.report_palette)) {
+        if(!from_stdin) {
+            samples = sample_file(input_file_path, *layout, options);
+        }
+        if(!samples) {
+            std::cerr << "Sampling " << input_file_path << " is not supported, reading all of it"
+                      << (options.report_palette ? " without reporting the palette error\n" : "\n");
+        }
+    }
+    std::optional<color_table> sampled_palette;
+    if(samples && options.palette_sample > 0) {
+        quantize::statistics statistics{ samples->palette.size() };
+        quantize::octree octree;
+        statistics.add(samples->palette.data(), samples->palette.size());
+        if(options.adaptive_palette && options.palette_quantizer == quantizer::octree) {
+            octree.add(samples->palette.data(), samples->palette.size());
+        }
+        sampled_palette = make_palette(statistics, octree, options);
+    }
+    if(derives_palette(options) && (!sampled_palette || options.report_palette)) {
+        quantize::statistics statistics{ std::uint64_t{ layout->width } * layout->height };
+        quantize::octree octree;
+        bool complete{};
+        if(from_stdin || options.palette_quantizer == quantizer::octree) {
+            if(from_stdin) {
+                spool_file.emplace();
+                spool.open(spool_file->path(), std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+                if(!spool) {
+                    std::cerr << "Failed to create temporary file " << spool_file->path() << '\n';
+                    return false;
+                }
+            }
+            complete = scan_rows(input, *layout, options.memory_budget, [&](const std::byte *rows, std::size_t count) {
+                statistics.add_rows(rows, count, *layout);
+                if(options.adaptive_palette && options.palette_quantizer == quantizer::octree) {
+                    octree.add_rows(rows, count, *layout);
+                }
+                if(from_stdin) {
+                    spool.write(reinterpret_cast<const char *>(rows), static_cast<std::streamsize>(count * layout->input_row_size));
+                }
+            });
+        } else {
+            complete = scan_partials(input, *layout, options.memory_budget, threads, statistics);
+        }
+        if(!complete) {
+            std::cerr << "Unexpected end of input file " << input_file_path << '\n';
+            return false;
+        }
+        if(from_stdin) {
+            if(!spool.flush()) {
+                std::cerr << "Failed to write temporary file " << spool_file->path() << '\n';
+                return false;
+            }
+            spool.seekg(0);
+            pixels = &spool;
+        } else {
+            input.seekg(static_cast<std::streamoff>(layout->input_pixel_offset));
+        }
+        layout->palette = make_palette(statistics, octree, options);
+    }
+    if(samples && options.report_palette) {
+        std::cerr << "Palette error (mean squared distance on a " << constants::holdout_sample_percent
+                  << "% row sample): ";
+        if(sampled_palette) {
+            std::cerr << quantize::quantization_error(samples->holdout, *sampled_palette) << " sampled, "
+                      << quantize::quantization_error(samples->holdout, layout->palette) << " full image\n";
+        } else {
+            std::cerr << quantize::quantization_error(samples->holdout, layout->palette) << '\n';
+        }
+    }
+    if(sampled_palette) {
+        layout->palette = *sampled_palette;
+    }
+
+    const auto oriented{ orient::make_layout(*layout, options.output_orientation, input_file_path) };
+    if(!oriented) {
+        return false;
+    }
+
+    // Disk reads, palette search and writes overlap: the reader, converter workers and the writer run concurrently.
+    // With error diffusion, a single pipeline worker hands the strips in order to the diffusion wavefront,
+    // which spreads the rows of each strip over the hardware threads instead.
+    color::lookup_tables tables{ options.memory_budget };
+    converter converter{ *layout, options, threads, tables };
+    // A rotated or flipped image is kept packed in memory, with a band of the oriented one: together they may take
+    // half of what the lookup tables leave of the budget.
+    auto strip_budget{ tables.strip_budget() };
+    if(options.output_orientation != orientation::none) {
+        const auto image_size{ std::uint64_t{ layout->output_row_size } * layout->height +
+                               orient::tile * oriented->output_row_size };
+        if(image_size > strip_budget / 2) {
+            std::cerr << "Orienting " << input_file_path << " needs a memory budget of at least "
+                      << ((2 * image_size + tables.budget() - strip_budget) >> 20) + 1 << " MiB\n";
+            return false;
+        }
+        strip_budget -= static_cast<std::size_t>(image_size);
+    }
+    const auto plan{ pipeline::make_plan(layout->input_row_size, layout->output_row_size,
+                                         converter.sequential() ? 1 : threads, strip_budget) };
+
+    // Open output BMP file, or stream it to stdout.
+    const bool to_stdout{ output_file_path == constants::standard_stream };
+    std::ofstream output_file;
+    if(!to_stdout) {
+        output_file.open(output_file_path, std::ios::binary);
+        if(!output_file) {
+            std::cerr << "Failed to open output file " << output_file_path << '\n';
+            return false;
+        }
+    }
+    auto &output{ to_stdout ? std::cout : static_cast<std::ostream &>(output_file) };
+    const auto headers{ make_output_headers(*oriented) };
+    output.write(reinterpret_cast<const char *>(headers.data()), headers.size());
+    output.flush();
+    const auto convert_strip{ [&converter](pipeline::strip &strip) {
+        converter.convert(strip.input.data(), strip.output.data(), strip.rows, strip.first_row);
+    } };
+    const auto report{ [&](const io::backend &source, const io::backend &sink) {
+        if(source.failed()) {
+            std::cerr << "Unexpected end of input file " << input_file_path << '\n';
+        }
+        if(sink.failed()) {
+            std::cerr << "Failed to write output file " << output_file_path << '\n';
+        }
+        return !source.failed() && !sink.failed();
+    } };
+
+    // A rotated or flipped image is converted into memory, then written oriented tile by tile.
+    if(options.output_orientation != orientation::none) {
+        io::stream_source source{ *pixels, layout->input_row_size };
+        io::memory_sink sink{ layout->output_row_size, layout->height };
+        pipeline::run(layout->height, plan, layout->input_row_size, layout->output_row_size,
+                      source, convert_strip, sink);
+        if(!source.failed() && !orient::write(sink.image(), *layout, *oriented, options.output_orientation, output)) {
+            std::cerr << "Failed to write output file " << output_file_path << '\n';
+            return false;
+        }
+        output.flush();
+        return report(source, sink);
+    }
+
+#ifdef SETM_BMP_IO_URING
+    if(options.io_uring && !from_stdin && !to_stdout) {
+        const auto strips{ plan.workers * constants::strips_per_worker };
+        io::uring reader_ring{ std::bit_ceil(static_cast<unsigned>(strips)) };
+        io::uring writer_ring{ std::bit_ceil(static_cast<unsigned>(strips)) };
+        io::file_descriptor input_fd{ ::open(input_file_path.c_str(), O_RDONLY | O_CLOEXEC) };
+        io::file_descriptor output_fd{ ::open(output_file_path.c_str(), O_WRONLY | O_CLOEXEC) };
+        if(reader_ring && writer_ring && input_fd && output_fd) {
+            io::uring_source source{ reader_ring, input_fd.get(), layout->input_pixel_offset, layout->input_row_size };
+            io::uring_sink sink{ writer_ring, output_fd.get(), headers.size(), layout->output_row_size };
+            pipeline::run(layout->height, plan, layout->input_row_size, layout->output_row_size,
+                          source, convert_strip, sink);
+            return report(source, sink);
+        }
+    }
+#endif
+
+    io::stream_source source{ *pixels, layout->input_row_size };
+    io::stream_sink sink{ output, layout->output_row_size };
+    pipeline::run(layout->height, plan, layout->input_row_size, layout->output_row_size,
+                  source, convert_strip, sink);
+    output.flush();
+    return report(source, sink);
+}
+
+// Opens an input file in `file`, or gives stdin for "-". Reports failures.
+std::istream *open_input(const fs::path &input_file_path, std::ifstream &file) {
+    if(input_file_path == constants::standard_stream) {
+        return &std::cin;
+    }
+    file.open(input_file_path, std::ios::binary);
+    if(!file) {
+        std::cerr << "Failed to open input file " << input_file_path << '\n';
+        return nullptr;
+    }
+    return &file;
+}
+
+// Opens an output file in `file`, or gives stdout for "-". Reports failures.
+std::ostream *open_output(const fs::path &output_file_path, std::ofstream &file) {
+    if(output_file_path == constants::standard_stream) {
+        return &std::cout;
+    }
+    file.open(output_file_path, std::ios::binary);
+    if(!file) {
+        std::cerr << "Failed to open output file " << output_file_path << '\n';
+        return nullptr;
+    }
+    return &file;
+}
+
+// One output of a fan-out conversion, with its own palette (and so bit depth), metric and dithering.
+struct variant {
+    fs::path output_file_path;
+    options settings;
+};
+
+// Convert a 24-bit BMP image to several outputs in one pass: every strip is read once and converted by the
+// converter of every output in turn, and the fan-out writer puts each part in its file. Variants have fixed
+// palettes, and the first one gives the I/O settings.
+bool convert_variants(const fs::path &input_file_path, std::span<const variant> variants) {
+    if(std::ranges::any_of(variants, [](const variant &variant) { return derives_palette(variant.settings); })) {
+        std::cerr << "Variants are converted with fixed palettes only\n";
+        return false;
+    }
+    const auto &options{ variants.front().settings };
+    std::ifstream input_file;
+    auto *input_stream{ open_input(input_file_path, input_file) };
+    if(!input_stream) {
+        return false;
+    }
+    auto &input{ *input_stream };
+    const auto base{ read_layout(input, input_file_path, constants::palette) };
+    if(!base) {
+        return false;
+    }
+    const auto threads{ std::max(std::thread::hardware_concurrency(), 1U) };
+
+    // Layouts and converters stay in place, as converters refer to their layout.
+    std::deque<bitmap_layout> layouts;
+    std::deque<std::ofstream> output_files;
+    std::vector<std::ostream *> outputs;
+    std::size_t output_row_size{};
+    for(const auto &variant : variants) {
+        auto &layout{ layouts.emplace_back(*base) };
+        if(!set_palette(layout, variant.settings.palette.value_or(constants::palette), input_file_path)) {
+            return false;
+        }
+        output_row_size += layout.output_row_size;
+        outputs.push_back(open_output(variant.output_file_path, output_files.emplace_back()));
+        if(!outputs.back()) {
+            return false;
+        }
+        const auto headers{ make_output_headers(layout) };
+        outputs.back()->write(reinterpret_cast<const char *>(headers.data()), headers.size());
+    }
+    color::lookup_tables tables{ options.memory_budget };
+    std::deque<converter> converters;
+    for(std::size_t index{}; index < variants.size(); ++index) {
+        converters.emplace_back(layouts[index], variants[index].settings, threads, tables);
+    }
+
+    const bool sequential{ std::ranges::any_of(converters, &converter::sequential) };
+    const auto plan{ pipeline::make_plan(base->input_row_size, output_row_size, sequential ? 1 : threads,
+                                         tables.strip_budget()) };
+    std::vector<io::fan_out_sink::output> parts;
+    std::size_t offset{};
+    for(std::size_t index{}; index < variants.size(); ++index) {
+        parts.push_back({ outputs[index], layouts[index].output_row_size, offset });
+        offset += plan.strip_rows * layouts[index].output_row_size;
+    }
+    const auto convert_strip{ [&](pipeline::strip &strip) {
+        for(std::size_t index{}; index < converters.size(); ++index) {
+            converters[index].convert(strip.input.data(), strip.output.data() + parts[index].offset, strip.rows,
+                                      strip.first_row);
+        }
+    } };
+    io::stream_source source{ input, base->input_row_size };
+    io::fan_out_sink sink{ parts };
+    pipeline::run(base->height, plan, base->input_row_size, output_row_size, source, convert_strip, sink);
+    for(auto *output : outputs) {
+        output->flush();
+    }
+    if(source.failed()) {
+        std::cerr << "Unexpected end of input file " << input_file_path << '\n';
+    }
+    if(sink.failed()) {
+        std::cerr << "Failed to write the outputs of " << input_file_path << '\n';
+    }
+    return !source.failed() && !sink.failed();
+}
+
+// Rectangle of an image, from its top left corner as displayed.
+struct region {
+    std::size_t x;
+    std::size_t y;
+    std::size_t width;
+    std::size_t height;
+};
+
+// Convert a region of a 24-bit BMP image. Only the rows covering the region are read, and only the bytes of its
+// columns; the output is a BMP of the size of the region, with the orientation of the input. Regions are
+// converted with fixed palettes.
+bool convert_region(const fs::path &input_file_path, const fs::path &output_file_path, const region &region,
+                    const options &options) {
+    if(derives_palette(options)) {
+        std::cerr << "Regions are converted with fixed palettes only\n";
+        return false;
+    }
+    const bool from_stdin{ input_file_path == constants::standard_stream };
+    std::ifstream input_file;
+    auto *input_stream{ open_input(input_file_path, input_file) };
+    if(!input_stream) {
+        return false;
+    }
+    auto &input{ *input_stream };
+    const auto image{ read_layout(input, input_file_path, constants::palette) };
+    if(!image) {
+        return false;
+    }
+    if(region.width == 0 || region.height == 0 || region.x > image->width || region.width > image->width - region.x ||
+       region.y > image->height || region.height > image->height - region.y) {
+        std::cerr << "Region " << region.width << 'x' << region.height << '+' << region.x << '+' << region.y
+                  << " does not fit in the " << image->width << 'x' << image->height << " image " << input_file_path << '\n';
+        return false;
+    }
+
+    // Bottom-up images (positive height) store the displayed top row last.
+    const bool bottom_up{ image->info_header.bi_height > 0 };
+    const auto first_row{ bottom_up ? image->height - region.y - region.height : region.y };
+    auto layout{ *image };
+    layout.width = region.width;
+    layout.height = region.height;
+    layout.input_row_size = (layout.width * 24 + 31) / 32 * 4;
+    layout.info_header.bi_width = static_cast<std::int32_t>(region.width);
+    layout.info_header.bi_height = static_cast<std::int32_t>(region.height) * (bottom_up ? 1 : -1);
+    if(!set_palette(layout, options.palette.value_or(constants::palette), input_file_path)) {
+        return false;
+    }
+
+    std::ofstream output_file;
+    auto *output_stream{ open_output(output_file_path, output_file) };
+    if(!output_stream) {
+        return false;
+    }
+    auto &output{ *output_stream };
+    const auto headers{ make_output_headers(layout) };
+    output.write(reinterpret_cast<const char *>(headers.data()), headers.size());
+
+    const auto threads{ std::max(std::thread::hardware_concurrency(), 1U) };
+    color::lookup_tables tables{ options.memory_budget };
+    converter converter{ layout, options, threads, tables };
+    const auto plan{ pipeline::make_plan(layout.input_row_size, layout.output_row_size,
+                                         converter.sequential() ? 1 : threads, tables.strip_budget()) };
+    io::window_source source{ input,
+                              !from_stdin,
+                              image->input_pixel_offset,
+                              image->input_pixel_offset + std::uint64_t{ first_row } * image->input_row_size + region.x * 3,
+                              image->input_row_size,
+                              region.width * 3,
+                              layout.input_row_size };
+    io::stream_sink sink{ output, layout.output_row_size };
+    pipeline::run(layout.height, plan, layout.input_row_size, layout.output_row_size, source,
+                  [&converter](pipeline::strip &strip) {
+                      converter.convert(strip.input.data(), strip.output.data(), strip.rows, strip.first_row);
+                  },
+                  sink);
+    output.flush();
+    if(source.failed()) {
+        std::cerr << "Unexpected end of input file " << input_file_path << '\n';
+    }
+    if(sink.failed()) {
+        std::cerr << "Failed to write output file " << output_file_path << '\n';
+    }
+    return !source.failed() && !sink.failed();
+}
+
+// Path of a pyramid level: `<output stem>_level<level><extension>` next to the output.
+fs::path pyramid_level_path(const fs::path &output_file_path, std::size_t level) {
+    auto path{ output_file_path };
+    return path.replace_filename(output_file_path.stem().string() + "_level" + std::to_string(level) +
+                                 output_file_path.extension().string());
+}
+
+// Halve padded 24-bit rows in both directions in place, averaging every 2x2 block (or what the edges leave of it).
+// Row `r` of the result overwrites the start of the buffer only once rows up to `2r + 1` have been read.
+void halve_rows(std::byte *pixels, std::size_t rows, const bitmap_layout &from, const bitmap_layout &to) {
+    std::vector<std::uint8_t> halved(to.width * 3);
+    for(std::size_t row{}; row * 2 < rows; ++row) {
+        const auto *top{ reinterpret_cast<const std::uint8_t *>(pixels + row * 2 * from.input_row_size) };
+        const auto *bottom{ row * 2 + 1 < rows ? top + from.input_row_size : top };
+        for(std::size_t column{}; column < to.width; ++column) {
+            const auto right{ column * 2 + 1 < from.width ? column * 2 + 1 : column * 2 };
+            for(std::size_t channel{}; channel < 3; ++channel) {
+                const auto sum{ top[column * 6 + channel] + top[right * 3 + channel] + bottom[column * 6 + channel] +
+                                bottom[right * 3 + channel] };
+                halved[column * 3 + channel] = static_cast<std::uint8_t>((sum + 2) / 4);
+            }
+        }
+        std::memcpy(pixels + row * to.input_row_size, halved.data(), halved.size());
+    }
+}
+
+// Convert a 24-bit BMP image and a pyramid of `levels` halvings of it (1/2, 1/4, ... scale) in one pass. Strips
+// are a multiple of 2^levels rows high, so that every worker halves its own strip level after level in place and
+// converts each level, without any state across strips. The fan-out writer sends every level to its file.
+// Pyramids are converted with fixed palettes.
+bool convert_pyramid(const fs::path &input_file_path, const fs::path &output_file_path, std::size_t levels,
+                     const options &options) {
+    if(derives_palette(options)) {
+        std::cerr << "Pyramids are converted with fixed palettes only\n";
+        return false;
+    }
+    if(output_file_path == constants::standard_stream) {
+        std::cerr << "Pyramids are written to files only\n";
+        return false;
+    }
+    std::ifstream input_file;
+    auto *input{ open_input(input_file_path, input_file) };
+    if(!input) {
+        return false;
+    }
+    const auto image{ read_layout(*input, input_file_path, options.palette.value_or(constants::palette)) };
+    if(!image) {
+        return false;
+    }
+
+    std::deque<bitmap_layout> layouts{ *image };
+    for(std::size_t level{ 1 }; level <= levels; ++level) {
+        auto &layout{ layouts.emplace_back(layouts.back()) };
+        layout.width = (layout.width + 1) / 2;
+        layout.height = (layout.height + 1) / 2;
+        layout.input_row_size = (layout.width * 24 + 31) / 32 * 4;
+        layout.info_header.bi_width = static_cast<std::int32_t>(layout.width);
+        layout.info_header.bi_height = static_cast<std::int32_t>(layout.height) * (image->info_header.bi_height > 0 ? 1 : -1);
+        if(!set_palette(layout, layout.palette, input_file_path)) {
+            return false;
+        }
+    }
+    std::size_t output_row_size{};
+    for(const auto &layout : layouts) {
+        output_row_size += layout.output_row_size;
+    }
+
+    const auto threads{ std::max(std::thread::hardware_concurrency(), 1U) };
+    color::lookup_tables tables{ options.memory_budget };
+    std::deque<converter> converters;
+    for(const auto &layout : layouts) {
+        converters.emplace_back(layout, options, threads, tables);
+    }
+    const bool sequential{ std::ranges::any_of(converters, &converter::sequential) };
+    // Strips are a multiple of 2^levels rows high, so that every level halves whole rows.
+    const auto plan{ pipeline::make_plan(image->input_row_size, output_row_size, sequential ? 1 : threads,
+                                         tables.strip_budget(), std::size_t{ 1 } << levels) };
+    const auto strips_size{ std::uint64_t{ constants::strips_per_worker } * (image->input_row_size + output_row_size) *
+                            plan.strip_rows * plan.workers };
+    if(strips_size > tables.strip_budget()) {
+        std::cerr << "Building a pyramid of " << input_file_path << " needs a memory budget of at least "
+                  << ((strips_size + tables.budget() - tables.strip_budget()) >> 20) + 1 << " MiB\n";
+        return false;
+    }
+
+    std::deque<std::ofstream> output_files;
+    std::vector<std::ostream *> outputs;
+    for(std::size_t level{}; level <= levels; ++level) {
+        outputs.push_back(open_output(level == 0 ? output_file_path : pyramid_level_path(output_file_path, level),
+                                      output_files.emplace_back()));
+        if(!outputs.back()) {
+            return false;
+        }
+        const auto headers{ make_output_headers(layouts[level]) };
+        outputs.back()->write(reinterpret_cast<const char *>(headers.data()), headers.size());
+    }
+    std::vector<io::fan_out_sink::output> parts;
+    std::size_t offset{};
+    for(std::size_t level{}; level <= levels; ++level) {
+        parts.push_back({ outputs[level], layouts[level].output_row_size, offset, level });
+        offset += (plan.strip_rows >> level) * layouts[level].output_row_size;
+    }
+    const auto convert_strip{ [&](pipeline::strip &strip) {
+        auto rows{ strip.rows };
+        for(std::size_t level{};; ++level) {
+            converters[level].convert(strip.input.data(), strip.output.data() + parts[level].offset, rows,
+                                      strip.first_row >> level);
+            if(level == levels) {
+                break;
+            }
+            halve_rows(strip.input.data(), rows, layouts[level], layouts[level + 1]);
+            rows = (rows + 1) / 2;
+        }
+    } };
+    io::stream_source source{ *input, image->input_row_size };
+    io::fan_out_sink sink{ parts };
+    pipeline::run(image->height, plan, image->input_row_size, output_row_size, source, convert_strip, sink);
+    for(auto *output : outputs) {
+        output->flush();
+    }
+    if(source.failed()) {
+        std::cerr << "Unexpected end of input file " << input_file_path << '\n';
+    }
+    if(sink.failed()) {
+        std::cerr << "Failed to write the pyramid of " << input_file_path << '\n';
+    }
+    return !source.failed() && !sink.failed();
+}
+
+// Expand an indexed BMP image (such as a converted one) back to 24 or 32 bits per pixel, for checks and previews.
+// Rows stream through the pipeline, so that workers expand strips while the reader and the writer run.
+bool expand_bmp(const fs::path &input_file_path, const fs::path &output_file_path, std::size_t bit_count,
+                const options &options) {
+    std::ifstream input_file;
+    auto *input{ open_input(input_file_path, input_file) };
+    if(!input) {
+        return false;
+    }
+    const auto image{ indexed::read(*input, input_file_path) };
+    if(!image) {
+        return false;
+    }
+    const auto output_row_size{ (image->width * bit_count + 31) / 32 * 4 };
+    if(std::uint64_t{ output_row_size } * image->height > UINT32_MAX - constants::input_headers_size) {
+        std::cerr << "File " << input_file_path << " is too large to expand\n";
+        return false;
+    }
+    auto file_header{ image->file_header };
+    auto info_header{ image->info_header };
+    info_header.bi_size = sizeof(bitmap_info_header);
+    info_header.bi_bit_count = static_cast<std::uint16_t>(bit_count);
+    info_header.bi_size_image = static_cast<std::uint32_t>(output_row_size * image->height);
+    info_header.bi_clr_used = 0;
+    info_header.bi_clr_important = 0;
+    file_header.bf_off_bits = constants::input_headers_size;
+    file_header.bf_size = file_header.bf_off_bits + info_header.bi_size_image;
+
+    std::ofstream output_file;
+    auto *output{ open_output(output_file_path, output_file) };
+    if(!output) {
+        return false;
+    }
+    output->write(reinterpret_cast<const char *>(&file_header), sizeof(file_header));
+    output->write(reinterpret_cast<const char *>(&info_header), sizeof(info_header));
+
+    const indexed::expander expander{ *image, bit_count / 8 };
+    const auto threads{ std::max(std::thread::hardware_concurrency(), 1U) };
+    const auto plan{ pipeline::make_plan(image->row_size, output_row_size, threads, options.memory_budget) };
+    const auto expand_strip{ [&](pipeline::strip &strip) {
+        for(std::size_t row{}; row < strip.rows; ++row) {
+            expander.expand(strip.input.data() + row * image->row_size, strip.output.data() + row * output_row_size);
+        }
+    } };
+    io::stream_source source{ *input, image->row_size };
+    io::stream_sink sink{ *output, output_row_size };
+    pipeline::run(image->height, plan, image->row_size, output_row_size, source, expand_strip, sink);
+    output->flush();
+    if(source.failed()) {
+        std::cerr << "Unexpected end of input file " << input_file_path << '\n';
+    }
+    if(sink.failed()) {
+        std::cerr << "Failed to write output file " << output_file_path << '\n';
+    }
+    return !source.failed() && !sink.failed();
+}
+
+// Remap an indexed BMP image (such as a converted one) to the palette of the options, keeping its bit depth: the
+// pixels are translated index by index and the color table of the header is replaced.
+bool remap_bmp(const fs::path &input_file_path, const fs::path &output_file_path, const options &options) {
+    std::ifstream input_file;
+    auto *input{ open_input(input_file_path, input_file) };
+    if(!input) {
+        return false;
+    }
+    const auto image{ indexed::read(*input, input_file_path) };
+    if(!image) {
+        return false;
+    }
+    const auto palette{ options.palette.value_or(constants::palette) };
+    const auto entries{ std::size_t{ 1 } << image->info_header.bi_bit_count };
+    if(palette.size() > entries) {
+        std::cerr << "The palette has more colors than the " << image->info_header.bi_bit_count << "-bit image "
+                  << input_file_path << " addresses\n";
+        return false;
+    }
+    auto file_header{ image->file_header };
+    auto info_header{ image->info_header };
+    info_header.bi_size = sizeof(bitmap_info_header);
+    info_header.bi_size_image = static_cast<std::uint32_t>(image->row_size * image->height);
+    info_header.bi_clr_used = static_cast<std::uint32_t>(entries);
+    info_header.bi_clr_important = 0;
+    file_header.bf_off_bits = static_cast<std::uint32_t>(constants::input_headers_size + entries * sizeof(rgb_quad));
+    file_header.bf_size = file_header.bf_off_bits + info_header.bi_size_image;
+
+    std::ofstream output_file;
+    auto *output{ open_output(output_file_path, output_file) };
+    if(!output) {
+        return false;
+    }
+    output->write(reinterpret_cast<const char *>(&file_header), sizeof(file_header));
+    output->write(reinterpret_cast<const char *>(&info_header), sizeof(info_header));
+    output->write(reinterpret_cast<const char *>(palette.data()), static_cast<std::streamsize>(entries * sizeof(rgb_quad)));
+
+    const indexed::remapper remapper{ *image, palette, effective_metric(options) };
+    const auto threads{ std::max(std::thread::hardware_concurrency(), 1U) };
+    const auto plan{ pipeline::make_plan(image->row_size, image->row_size, threads, options.memory_budget) };
+    const auto remap_strip{ [&](pipeline::strip &strip) {
+        for(std::size_t row{}; row < strip.rows; ++row) {
+            remapper.remap(strip.input.data() + row * image->row_size, strip.output.data() + row * image->row_size);
+        }
+    } };
+    io::stream_source source{ *input, image->row_size };
+    io::stream_sink sink{ *output, image->row_size };
+    pipeline::run(image->height, plan, image->row_size, image->row_size, source, remap_strip, sink);
+    output->flush();
+    if(source.failed()) {
+        std::cerr << "Unexpected end of input file " << input_file_path << '\n';
+    }
+    if(sink.failed()) {
+        std::cerr << "Failed to write output file " << output_file_path << '\n';
+    }
+    return !source.failed() && !sink.failed();
+}
+
+// Convert a 24-bit BMP image resized to `width` by `height` with a resampling filter. Resampled rows are made strip
+// by strip on the reader stage and go straight to the converter workers; neither the input nor the resized image
+// is ever held whole. Resized images are converted with fixed palettes.
+bool convert_resized(const fs::path &input_file_path, const fs::path &output_file_path, std::size_t width,
+                     std::size_t height, resample::filter filter, const options &options) {
+    if(derives_palette(options)) {
+        std::cerr << "Resized images are converted with fixed palettes only\n";
+        return false;
+    }
+    std::ifstream input_file;
+    auto *input{ open_input(input_file_path, input_file) };
+    if(!input) {
+        return false;
+    }
+    const auto image{ read_layout(*input, input_file_path, constants::palette) };
+    if(!image) {
+        return false;
+    }
+    // A zero side keeps the aspect ratio.
+    if(width == 0 && height != 0) {
+        width = std::max<std::size_t>(std::llround(static_cast<double>(image->width) * height / image->height), 1);
+    } else if(height == 0 && width != 0) {
+        height = std::max<std::size_t>(std::llround(static_cast<double>(image->height) * width / image->width), 1);
+    }
+    if(width == 0 || height == 0 || image->height == 0 || width > INT32_MAX || height > INT32_MAX) {
+        std::cerr << "Cannot resize " << input_file_path << " to " << width << 'x' << height << '\n';
+        return false;
+    }
+    auto layout{ *image };
+    layout.width = width;
+    layout.height = height;
+    layout.input_row_size = (layout.width * 24 + 31) / 32 * 4;
+    layout.info_header.bi_width = static_cast<std::int32_t>(width);
+    layout.info_header.bi_height = static_cast<std::int32_t>(height) * (image->info_header.bi_height > 0 ? 1 : -1);
+    if(!set_palette(layout, options.palette.value_or(constants::palette), input_file_path)) {
+        return false;
+    }
+
+    std::ofstream output_file;
+    auto *output{ open_output(output_file_path, output_file) };
+    if(!output) {
+        return false;
+    }
+    const auto headers{ make_output_headers(layout) };
+    output->write(reinterpret_cast<const char *>(headers.data()), headers.size());
+
+    const auto threads{ std::max(std::thread::hardware_concurrency(), 1U) };
+    color::lookup_tables tables{ options.memory_budget };
+    converter converter{ layout, options, threads, tables };
+    const auto plan{ pipeline::make_plan(layout.input_row_size, layout.output_row_size,
+                                         converter.sequential() ? 1 : threads, tables.strip_budget()) };
+    resample::source source{ *input, image->width, image->input_row_size, image->height, layout.width,
+                             layout.height, layout.input_row_size, filter };
+    io::stream_sink sink{ *output, layout.output_row_size };
+    pipeline::run(layout.height, plan, layout.input_row_size, layout.output_row_size, source,
+                  [&converter](pipeline::strip &strip) {
+                      converter.convert(strip.input.data(), strip.output.data(), strip.rows, strip.first_row);
+                  },
+                  sink);
+    output->flush();
+    if(source.failed()) {
+        std::cerr << "Unexpected end of input file " << input_file_path << '\n';
+    }
+    if(sink.failed()) {
+        std::cerr << "Failed to write output file " << output_file_path << '\n';
+    }
+    return !source.failed() && !sink.failed();
+}
+
+// Counts the distinct colors of a 24-bit BMP, or of stdin for "-".
+std::optional<std::uint64_t> count_colors(const fs::path &input_file_path, const options &options) {
+    const bool from_stdin{ input_file_path == constants::standard_stream };
+    std::ifstream input_file;
+    if(!from_stdin) {
+        input_file.open(input_file_path, std::ios::binary);
+        if(!input_file) {
+            std::cerr << "Failed to open input file " << input_file_path << '\n';
+            return std::nullopt;
+        }
+    }
+    auto &input{ from_stdin ? std::cin : static_cast<std::istream &>(input_file) };
+    const auto layout{ read_layout(input, input_file_path, constants::palette) };
+    if(!layout) {
+        return std::nullopt;
+    }
+    quantize::color_set colors{ std::uint64_t{ layout->width } * layout->height };
+    const auto threads{ std::max(std::thread::hardware_concurrency(), 1U) };
+    if(!scan_partials(input, *layout, options.memory_budget, threads, colors)) {
+        std::cerr << "Unexpected end of input file " << input_file_path << '\n';
+        return std::nullopt;
+    }
+    return colors.size();
+}
+
+// Convert a whole 24-bit BMP image held in memory. Returns an empty buffer on failure.
+std::vector<std::byte> convert_in_memory(std::span<const std::byte> input, const fs::path &input_file_path,
+                                         const options &options, color::lookup_tables &tables) {
+    bitmap_file_header bmp_file_header;
+    bitmap_info_header bmp_info_header;
+    if(input.size() < sizeof(bitmap_file_header) + sizeof(bitmap_info_header)) {
+        std::cerr << "File " << input_file_path << " is not a BMP file\n";
+        return {};
+    }
+    std::memcpy(&bmp_file_header, input.data(), sizeof(bitmap_file_header));
+    std::memcpy(&bmp_info_header, input.data() + sizeof(bitmap_file_header), sizeof(bitmap_info_header));
+    auto layout{
+        make_layout(bmp_file_header, bmp_info_header, input_file_path, options.palette.value_or(constants::palette))
+    };
+    if(!layout) {
+        return {};
+    }
+    if(input.size() < layout->input_pixel_offset + std::uint64_t{ layout->input_row_size } * layout->height) {
+        std::cerr << "Unexpected end of input file " << input_file_path << '\n';
+        return {};
+    }
+    const auto *pixels{ input.data() + layout->input_pixel_offset };
+    if(derives_palette(options)) {
+        quantize::statistics statistics{ std::uint64_t{ layout->width } * layout->height };
+        statistics.add_rows(pixels, layout->height, *layout);
+        quantize::octree octree;
+        if(options.adaptive_palette && options.palette_quantizer == quantizer::octree) {
+            octree.add_rows(pixels, layout->height, *layout);
+        }
+        layout->palette = make_palette(statistics, octree, options);
+    }
+
+    // A rotated or flipped image is converted aside, then oriented into the output.
+    const auto oriented{ orient::make_layout(*layout, options.output_orientation, input_file_path) };
+    if(!oriented) {
+        return {};
+    }
+    std::vector<std::byte> output(oriented->output_size());
+    const auto headers{ make_output_headers(*oriented) };
+    std::ranges::copy(headers, output.begin());
+    converter converter{ *layout, options, 1, tables };
+    if(options.output_orientation == orientation::none) {
+        converter.convert(pixels, output.data() + headers.size(), layout->height, 0);
+    } else {
+        std::vector<std::byte> image(std::size_t{ layout->output_row_size } * layout->height);
+        converter.convert(pixels, image.data(), layout->height, 0);
+        orient::write(image, *layout, *oriented, options.output_orientation, output.data() + headers.size());
+    }
+    return output;
+}
+
+namespace batch {
+
+// Output path of a batch conversion: `<output directory>/<input stem>_4bit.bmp`.
+fs::path output_path(const fs::path &output_directory, const fs::path &input_file_path) {
+    return output_directory / (input_file_path.stem().string() + "_4bit.bmp");
+}
+
+// Convert whole files in memory on worker threads, `convert(index)` handling one file.
+template<typename Convert>
+void for_each_file(std::size_t count, Convert &&convert) {
+    std::atomic<std::size_t> next{};
+    std::vector<std::jthread> threads(std::min<std::size_t>(count, std::max(std::thread::hardware_concurrency(), 1U)));
+    for(auto &thread : threads) {
+        thread = std::jthread{ [&] {
+            for(std::size_t index; (index = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+                convert(index);
+            }
+        } };
+    }
+}
+
+// Split `inputs` into windows of up to `constants::batch_window` files that add up to at most `bytes` (`sizes` gives
+// the size of every input). A file larger than `bytes` gets a window of its own.
+std::vector<std::span<const fs::path>> make_windows(std::span<const fs::path> inputs,
+                                                    std::span<const std::uintmax_t> sizes, std::uintmax_t bytes) {
+    std::vector<std::span<const fs::path>> windows;
+    for(std::size_t first{}; first < inputs.size();) {
+        std::size_t count{};
+        for(std::uintmax_t total{}; first + count < inputs.size() && count < constants::batch_window; ++count) {
+            total += sizes[first + count];
+            if(count != 0 && total > bytes) {
+                break;
+            }
+        }
+        windows.push_back(inputs.subspan(first, count));
+        first += count;
+    }
+    return windows;
+}
+
+// Portable batch backend: the worker threads read, convert and write the whole files of a window with blocking
+// streams, one window after the other.
+std::size_t convert_small_files(std::span<const std::span<const fs::path>> windows, const fs::path &output_directory,
+                                const options &options, color::lookup_tables &tables) {
+    std::atomic<std::size_t> failures{};
+    for(const auto inputs : windows) {
+        for_each_file(inputs.size(), [&](std::size_t index) {
+            std::ifstream input_file{ inputs[index], std::ios::binary | std::ios::ate };
+            if(!input_file) {
+                std::cerr << "Failed to open input file " << inputs[index] << '\n';
+                ++failures;
+                return;
+            }
+            std::vector<std::byte> input(static_cast<std::size_t>(input_file.tellg()));
+            input_file.seekg(0);
+            input_file.read(reinterpret_cast<char *>(input.data()), input.size());
+            const auto output{ convert_in_memory(input, inputs[index], options, tables) };
+            if(output.empty()) {
+                ++failures;
+                return;
+            }
+            const auto output_file_path{ output_path(output_directory, inputs[index]) };
+            std::ofstream output_file{ output_file_path, std::ios::binary };
+            output_file.write(reinterpret_cast<const char *>(output.data()), output.size());
+            if(!output_file) {
+                std::cerr << "Failed to write output file " << output_file_path << '\n';
+                ++failures;
+            }
+        });
+    }
+    return failures;
+}
+
+#ifdef SETM_BMP_IO_URING
+
+// A file of an io_uring batch window.
+struct uring_file {
+    fs::path input_file_path;
+    io::file_descriptor input_fd;
+    io::file_descriptor output_fd;
+    std::vector<std::byte> input;
+    std::vector<std::byte> output;
+    std::size_t pending{};  // Requests in flight.
+    std::size_t transferred{};  // Bytes of the current read or write already done.
+    bool failed{};
+};
+
+// io_uring batch backend. Files are handled in windows: the reads of a whole window go to the kernel in one
+// submission, and while one window is converted the reads of the next one and the writes of the previous one
+// are in flight.
+std::size_t convert_small_files(io::uring &ring, std::span<const std::span<const fs::path>> windows,
+                                const fs::path &output_directory, const options &options,
+                                color::lookup_tables &tables) {
+    std::size_t failures{};
+    // Queue the rest of the read of a file, or once it has been converted, of its write.
+    const auto transfer{ [&ring](uring_file &file) {
+        const bool write{ !file.output.empty() };
+        auto &buffer{ write ? file.output : file.input };
+        auto &sqe{ ring.next_sqe() };
+        sqe.opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe.fd = (write ? file.output_fd : file.input_fd).get();
+        sqe.addr = reinterpret_cast<std::uint64_t>(buffer.data() + file.transferred);
+        sqe.len = static_cast<std::uint32_t>(buffer.size() - file.transferred);
+        sqe.off = file.transferred;
+        sqe.user_data = reinterpret_cast<std::uint64_t>(&file);
+        ++file.pending;
+    } };
+    // Short transfers are resubmitted for the rest of the file.
+    const auto reap{ [&ring, &transfer](unsigned wait_for) {
+        ring.submit(wait_for);
+        while(const auto cqe{ ring.pop_completion() }) {
+            auto &file{ *reinterpret_cast<uring_file *>(cqe->user_data) };
+            --file.pending;
+            if(cqe->result > 0) {
+                file.transferred += static_cast<std::size_t>(cqe->result);
+            }
+            if(file.transferred != (file.output.empty() ? file.input.size() : file.output.size())) {
+                if(cqe->result > 0) {
+                    transfer(file);
+                } else {
+                    file.failed = true;
+                }
+            }
+        }
+    } };
+    const auto wait_for_window{ [&reap](std::vector<uring_file> &window) {
+        for(auto &file : window) {
+            while(file.pending != 0) {
+                reap(1);
+            }
+        }
+    } };
+    const auto start_reads{ [&](std::span<const fs::path> paths) {
+        std::vector<uring_file> window(paths.size());
+        for(std::size_t index{}; index < paths.size(); ++index) {
+            auto &file{ window[index] };
+            file.input_file_path = paths[index];
+            file.input_fd = io::file_descriptor{ ::open(paths[index].c_str(), O_RDONLY | O_CLOEXEC) };
+            struct stat status{};
+            if(!file.input_fd || ::fstat(file.input_fd.get(), &status) != 0) {
+                std::cerr << "Failed to open input file " << paths[index] << '\n';
+                file.failed = true;
+                continue;
+            }
+            file.input.resize(static_cast<std::size_t>(status.st_size));
+            transfer(file);
+        }
+        reap(0);
+        return window;
+    } };
+
+    const auto finish_writes{ [&wait_for_window](std::vector<uring_file> &window) {
+        wait_for_window(window);
+        return static_cast<std::size_t>(std::ranges::count_if(window, [](const auto &file) {
+            return file.failed && !file.output.empty();
+        }));
+    } };
+
+    if(windows.empty()) {
+        return 0;
+    }
+    auto reading{ start_reads(windows.front()) };
+    std::vector<uring_file> writing;
+    for(std::size_t next{ 1 }; next <= windows.size(); ++next) {
+        auto window{ std::exchange(reading, std::vector<uring_file>{}) };
+        if(next < windows.size()) {
+            reading = start_reads(windows[next]);
+        }
+        wait_for_window(window);
+
+        for_each_file(window.size(), [&window, &options, &tables](std::size_t index) {
+            auto &file{ window[index] };
+            if(file.failed) {
+                if(file.input_fd) {
+                    std::cerr << "Failed to read input file " << file.input_file_path << '\n';
+                }
+                return;
+            }
+            file.output = convert_in_memory(file.input, file.input_file_path, options, tables);
+            file.failed = file.output.empty();
+            file.input = {};
+        });
+
+        for(auto &file : window) {
+            if(file.failed) {
+                ++failures;
+                continue;
+            }
+            const auto output_file_path{ output_path(output_directory, file.input_file_path) };
+            file.output_fd = io::file_descriptor{
+                ::open(output_file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+            };
+            if(!file.output_fd) {
+                std::cerr << "Failed to open output file " << output_file_path << '\n';
+                file.failed = true;
+                file.output = {};
+                ++failures;
+                continue;
+            }
+            file.transferred = 0;
+            transfer(file);
+        }
+        reap(0);
+
+        // The previous window has had a whole conversion step to finish its writes.
+        failures += finish_writes(writing);
+        writing = std::move(window);
+    }
+    return failures + finish_writes(writing);
+}
+
+#endif
+
+// Colors of a set of images, persisted next to the batch so that a rerun only scans the inputs that are new.
+// Histograms merge by addition, so the inputs added since the last run are scanned and added to the stored
+// histogram; a changed or removed input makes the whole set be scanned again. The palette is derived again from the
+// stored colors when the options it depends on change.
+struct palette_artifact {
+    static constexpr std::string_view format{ "setm-bmp-palette 2" };
+
+    // Options the palette was derived with.
+    struct settings {
+        quantizer palette_quantizer{ quantizer::median_cut };
+        std::optional<std::int64_t> refine_milliseconds;
+        std::uint64_t seed{};
+
+        bool operator==(const settings &) const = default;
+    };
+
+    static settings settings_of(const options &options) {
+        if(!options.refine_palette) {
+            return { options.palette_quantizer, std::nullopt, 0 };
+        }
+        return { options.palette_quantizer, options.refinement.time_budget.count(), options.refinement.seed };
+    }
+
+    struct input {
+        std::uintmax_t size;
+        std::int64_t modified;
+        fs::path path;
+
+        bool operator==(const input &) const = default;
+
+        // Inputs of a batch have distinct paths, so the path alone is hashed.
+        struct hash {
+            std::size_t operator()(const input &input) const noexcept { return fs::hash_value(input.path); }
+        };
+    };
+
+    static std::optional<input> describe(const fs::path &path) {
+        std::error_code error;
+        const auto size{ fs::file_size(path, error) };
+        const auto modified{ fs::last_write_time(path, error) };
+        if(error) {
+            return std::nullopt;
+        }
+        return input{ size, static_cast<std::int64_t>(modified.time_since_epoch().count()), fs::absolute(path, error) };
+    }
+
+    // Adds the colors of an image.
+    void add(const quantize::statistics &statistics) {
+        histogram.merge(statistics.binned);
+        const auto keys{ statistics.colors.keys(constants::adaptive_colors) };
+        if(!keys || !few_colors) {
+            few_colors.reset();
+            return;
+        }
+        std::vector<std::uint32_t> merged;
+        std::ranges::set_union(*few_colors, *keys, std::back_inserter(merged));
+        few_colors = merged.size() <= constants::adaptive_colors ? std::optional{ std::move(merged) } : std::nullopt;
+    }
+
+    // Palette of the set: its colors when there are few enough of them, otherwise the median cut of the histogram
+    // (or an octree fed with the average color of every bin), refined if asked for.
+    color_table derive_palette(const options &options) const {
+        if(few_colors) {
+            return quantize::color_set::palette_of(*few_colors);
+        }
+        color_table palette;
+        if(options.palette_quantizer == quantizer::octree) {
+            quantize::octree octree;
+            for(std::size_t bin{}; bin < quantize::histogram::bins; ++bin) {
+                if(const auto count{ histogram.count(bin) }; count != 0) {
+                    const auto color{ histogram.average(std::array{ bin }) };
+                    octree.add(rgb_triple{ color.blue, color.green, color.red }, count);
+                }
+            }
+            palette = octree.palette();
+        } else {
+            palette = quantize::median_cut(histogram);
+        }
+        return options.refine_palette ? quantize::refine(histogram, palette, options.refinement) : palette;
+    }
+
+    bool save(const fs::path &path) const {
+        std::ofstream file{ path };
+        file << format << "\npalette";
+        for(const auto &color : palette) {
+            file << ' ' << std::uint32_t{ color.red } << ',' << std::uint32_t{ color.green } << ',' << std::uint32_t{ color.blue };
+        }
+        file << "\nsettings " << (derived_with.palette_quantizer == quantizer::octree ? "octree" : "median-cut") << ' ';
+        if(derived_with.refine_milliseconds) {
+            file << *derived_with.refine_milliseconds;
+        } else {
+            file << "none";
+        }
+        file << ' ' << derived_with.seed << "\ncolors ";
+        if(few_colors) {
+            file << few_colors->size();
+            for(const auto key : *few_colors) {
+                file << ' ' << key;
+            }
+        } else {
+            file << "many";
+        }
+        file << "\ninputs " << inputs.size() << '\n';
+        for(const auto &input : inputs) {
+            file << input.size << ' ' << input.modified << ' ' << input.path.string() << '\n';
+        }
+        file << "histogram ";
+        histogram.write(file);
+        return static_cast<bool>(file);
+    }
+
+    static std::optional<palette_artifact> load(const fs::path &path) {
+        std::ifstream file{ path };
+        std::string line;
+        if(!std::getline(file, line) || line != format) {
+            return std::nullopt;
+        }
+        palette_artifact artifact;
+        std::string label;
+        file >> label;
+        for(auto &color : artifact.palette) {
+            std::uint32_t red{}, green{}, blue{};
+            char comma{};
+            file >> red >> comma >> green >> comma >> blue;
+            color = { static_cast<std::uint8_t>(blue), static_cast<std::uint8_t>(green), static_cast<std::uint8_t>(red), 0 };
+        }
+        std::string quantizer_name, refine_milliseconds;
+        file >> label >> quantizer_name >> refine_milliseconds >> artifact.derived_with.seed;
+        artifact.derived_with.palette_quantizer = quantizer_name == "octree" ? quantizer::octree : quantizer::median_cut;
+        if(refine_milliseconds != "none") {
+            artifact.derived_with.refine_milliseconds = utils::parse_number<std::int64_t>(refine_milliseconds);
+            if(!artifact.derived_with.refine_milliseconds) {
+                return std::nullopt;
+            }
+        }
+        std::string colors;
+        file >> label >> colors;
+        if(colors == "many") {
+            artifact.few_colors.reset();
+        } else {
+            const auto count{ utils::parse_number<std::size_t>(colors) };
+            if(!count || *count > constants::adaptive_colors) {
+                return std::nullopt;
+            }
+            artifact.few_colors.emplace(*count);
+            for(auto &key : *artifact.few_colors) {
+                file >> key;
+            }
+        }
+        std::size_t count{};
+        file >> label >> count;
+        for(std::size_t index{}; index < count && file; ++index) {
+            input input{};
+            file >> input.size >> input.modified;
+            file.ignore(1);
+            std::string input_path;
+            std::getline(file, input_path);
+            input.path = input_path;
+            artifact.inputs.push_back(std::move(input));
+        }
+        file >> label;
+        if(!file || !artifact.histogram.read(file)) {
+            return std::nullopt;
+        }
+        return artifact;
+    }
+
+    color_table palette{ constants::adaptive_colors };
+    // Distinct colors of the set as color_set keys, while there are at most as many as palette entries.
+    std::optional<std::vector<std::uint32_t>> few_colors{ std::vector<std::uint32_t>{} };
+    settings derived_with;
+    std::vector<input> inputs;
+    quantize::histogram histogram;
+};
+
+// Palette shared by all the inputs of a batch, from the artifact of a previous run where it still applies.
+std::optional<color_table> shared_palette(std::span<const fs::path> paths, const options &options) {
+    std::vector<palette_artifact::input> inputs;
+    for(const auto &path : paths) {
+        const auto input{ palette_artifact::describe(path) };
+        if(!input) {
+            std::cerr << "Failed to open input file " << path << '\n';
+            return std::nullopt;
+        }
+        inputs.push_back(*input);
+    }
+
+    // Reuse the stored colors of the inputs that are unchanged, as long as none of the stored ones went away.
+    auto artifact{ palette_artifact::load(*options.shared_palette).value_or(palette_artifact{}) };
+    using input_set = std::unordered_set<palette_artifact::input, palette_artifact::input::hash>;
+    const input_set current(inputs.begin(), inputs.end());
+    if(!std::ranges::all_of(artifact.inputs, [&current](const auto &stored) { return current.contains(stored); })) {
+        artifact = {};
+    }
+    const input_set stored(artifact.inputs.begin(), artifact.inputs.end());
+    std::vector<std::size_t> pending;
+    for(std::size_t index{}; index < inputs.size(); ++index) {
+        if(!stored.contains(inputs[index])) {
+            pending.push_back(index);
+        }
+    }
+    const auto settings{ palette_artifact::settings_of(options) };
+    if(pending.empty() && !artifact.inputs.empty() && artifact.derived_with == settings) {
+        return artifact.palette;
+    }
+
+    // Scan the new inputs in parallel, one file per worker at a time, merging each into the artifact.
+    std::mutex mutex;
+    std::atomic<bool> failed{};
+    for_each_file(pending.size(), [&](std::size_t index) {
+        const auto &path{ paths[pending[index]] };
+        std::ifstream file{ path, std::ios::binary };
+        const auto layout{ read_layout(file, path, constants::palette) };
+        if(!layout) {
+            failed = true;
+            return;
+        }
+        quantize::statistics statistics{ std::uint64_t{ layout->width } * layout->height };
+        if(!scan_rows(file, *layout, options.memory_budget, [&](const std::byte *rows, std::size_t count) {
+               statistics.add_rows(rows, count, *layout);
+           })) {
+            std::cerr << "Unexpected end of input file " << path << '\n';
+            failed = true;
+            return;
+        }
+        const std::scoped_lock lock{ mutex };
+        artifact.add(statistics);
+        artifact.inputs.push_back(inputs[pending[index]]);
+    });
+    if(failed) {
+        return std::nullopt;
+    }
+    artifact.palette = artifact.derive_palette(options);
+    artifact.derived_with = settings;
+    if(!artifact.save(*options.shared_palette)) {
+        std::cerr << "Failed to write palette file " << *options.shared_palette << '\n';
+    }
+    return artifact.palette;
+}
+
+// Convert every input into `output_directory`. Returns the number of files that failed.
+std::size_t convert(std::span<const fs::path> inputs, const fs::path &output_directory, const options &batch_options) {
+    // A shared palette is derived from all the inputs first, then every input is converted with it.
+    auto options{ batch_options };
+    if(options.shared_palette && !options.palette) {
+        options.palette = shared_palette(inputs, options);
+        if(!options.palette) {
+            return inputs.size();
+        }
+    }
+
+    // Small files are converted whole, many at a time; large ones are streamed through the strip pipeline.
+    // Half the budget is kept for the lookup tables of the files converted at once. Up to three windows of whole
+    // files (read, converted, written) are alive at once, so the files of a window add up to at most a sixth.
+    color::lookup_tables tables{ options.memory_budget };
+    const auto window_bytes{ options.memory_budget / 6 };
+    const auto file_limit{ std::min<std::uintmax_t>(constants::batch_file_limit, window_bytes) };
+    std::vector<fs::path> small_files;
+    std::vector<std::uintmax_t> small_file_sizes;
+    std::vector<fs::path> large_files;
+    for(const auto &input : inputs) {
+        std::error_code error;
+        const auto size{ fs::file_size(input, error) };
+        if(!error && size > file_limit) {
+            large_files.push_back(input);
+        } else {
+            small_files.push_back(input);
+            small_file_sizes.push_back(error ? 0 : size);
+        }
+    }
+    const auto windows{ make_windows(small_files, small_file_sizes, window_bytes) };
+    if(derives_palette(batch_options) && (options.palette_sample > 0 || options.report_palette)) {
+        if(options.shared_palette) {
+            std::cerr << "A shared palette is derived from all the pixels: --palette-sample and --report-palette have no effect\n";
+        } else if(!small_files.empty()) {
+            std::cerr << "Small files are converted whole: --palette-sample and --report-palette apply to files over "
+                      << file_limit << " bytes only\n";
+        }
+    }
+
+    std::error_code error;
+    fs::create_directories(output_directory, error);
+    if(error) {
+        std::cerr << "Failed to create output directory " << output_directory << '\n';
+        return inputs.size();
+    }
+
+    std::size_t failures{};
+#ifdef SETM_BMP_IO_URING
+    io::uring ring{ options.io_uring ? 4 * static_cast<unsigned>(constants::batch_window) : 0U };
+    failures += ring ? convert_small_files(ring, windows, output_directory, options, tables)
+                     : convert_small_files(windows, output_directory, options, tables);
+#else
+    failures += convert_small_files(windows, output_directory, options, tables);
+#endif
+    for(const auto &input : large_files) {
+        failures += !convert_bmp_24_to_4_depth(input, output_path(output_directory, input), options);
+    }
+    return failures;
+}
+
+}  // namespace batch
+
+}  // namespace setm::bmp
+
+int main(int argc, char *argv[]) {
+    using namespace setm::bmp;
+
+    const auto usage{ [program = argv[0]] {
+        std::cerr << "Usage: " << program << " [options] [input.bmp|- [output.bmp|-]]\n"
+                  << "       " << program << " [options] --batch <output directory> <input.bmp>...\n"
+                  << "Options:\n"
+                  << "  --no-io-uring           use blocking streams instead of io_uring\n"
+                  << "  --memory-budget <MiB>   ceiling for pixel buffers (default "
+                  << (constants::memory_budget >> 20) << ")\n"
+                  << "  --report-memory         print the peak resident set size\n"
+                  << "  --dither <mode>         none (default), floyd-steinberg, bayer4 or bayer8\n"
+                  << "  --dither-tile <bmp>     ordered dithering with a threshold tile (e.g. blue noise)\n"
+                  << "  --metric <name>         color distance: rgb (default), redmean, luma, oklab, cie76 or cie94\n"
+                  << "  --linear-light          quantize and dither in linear light\n"
+                  << "  --palette <name>        built-in palette: scv (default), mono, cga, cga16, ega, gameboy, nes,\n"
+                  << "                          c64, pico8, rgb332 or xterm256, or a .pal, .gpl, .act or .bgra file\n"
+                  << "  --crop <x>,<y>,<width>,<height> convert only this region, reading only its rows and columns\n"
+                  << "  --rotate <degrees>      rotate the converted image clockwise by 90, 180 or 270 degrees\n"
+                  << "  --flip <direction>      mirror the converted image: horizontal or vertical\n"
+                  << "  --expand 24|32          expand a 1, 4 or 8-bit BMP (e.g. a converted one) to 24 or 32 bits\n"
+                  << "  --remap                 remap a 1, 4 or 8-bit BMP to --palette (and --metric) without decoding it\n"
+                  << "  --pyramid <levels>      also write 1 to 6 halvings of the output as <output>_level<n>.bmp\n"
+                  << "  --resize <width>x<height> resize while converting (a zero side keeps the aspect ratio)\n"
+                  << "  --filter <name>         resampling filter of --resize: box (default), bilinear or lanczos\n"
+                  << "  --variant <palette>[,<dither>] <output.bmp>\n"
+                  << "                          also convert to this palette and dithering, in the same pass\n"
+                  << "  --full-lookup-table     build the nearest color table up front and report its build time\n"
+                  << "  --lookup-table-cache <dir> map complete nearest color tables from <dir>, storing them there on a miss\n"
+                  << "  --adaptive-palette      derive the palette from the image (median cut)\n"
+                  << "  --count-colors          print the number of distinct colors of the inputs\n"
+                  << "  --quantizer <name>      adaptive palette by median-cut (default) or octree\n"
+                  << "  --refine-palette <ms>   refine the palette by k-means within a time budget\n"
+                  << "  --palette-sample <%>    estimate the adaptive palette from this percentage of the rows\n"
+                  << "  --report-palette        print the palette error estimated on a sample of the input\n"
+                  << "  --shared-palette <file> in batch mode, convert all inputs with one adaptive palette kept in <file>\n"
+                  << "  --palette-seed <n>      seed of the k-means refinement (default 0)\n";
+        return EXIT_FAILURE;
+    } };
+
+    const auto set_dithering{ [](std::string_view mode, options &options) {
+        if(mode == "none") {
+            options.dithering_mode = dithering::none;
+        } else if(mode == "floyd-steinberg") {
+            options.dithering_mode = dithering::floyd_steinberg;
+        } else if(mode == "bayer4") {
+            options.dithering_mode = dithering::ordered;
+            options.threshold_map = dither::make_bayer_map<4>();
+        } else if(mode == "bayer8") {
+            options.dithering_mode = dithering::ordered;
+            options.threshold_map = dither::make_bayer_map<8>();
+        } else {
+            return false;
+        }
+        return true;
+    } };
+
+    options options;
+    std::vector<fs::path> paths;
+    std::optional<region> crop;
+    std::size_t pyramid_levels{};
+    std::size_t expand_bit_count{};
+    bool remap{};
+    // --rotate or --flip, if given.
+    std::string_view orientation_option;
+    std::optional<std::pair<std::size_t, std::size_t>> resize;
+    auto resize_filter{ resample::filter::box };
+    // Extra outputs as given: palette, optional dithering after a comma, output path.
+    std::vector<std::pair<std::string_view, fs::path>> variant_specs;
+    std::optional<fs::path> batch_output_directory;
+    bool count_colors_only{};
+    for(int index{ 1 }; index < argc; ++index) {
+        const std::string_view argument{ argv[index] };
+        const auto has_value{ index + 1 < argc };
+        if(argument == "--no-io-uring") {
+            options.io_uring = false;
+        } else if(argument == "--batch" && has_value) {
+            batch_output_directory = argv[++index];
+        } else if(argument == "--memory-budget" && has_value) {
+            const auto mebibytes{ utils::parse_number<std::size_t>(argv[++index]) };
+            if(!mebibytes || *mebibytes == 0) {
+                return usage();
+            }
+            options.memory_budget = *mebibytes << 20;
+        } else if(argument == "--report-memory") {
+            options.report_memory = true;
+        } else if(argument == "--dither" && has_value) {
+            if(!set_dithering(argv[++index], options)) {
+                return usage();
+            }
+        } else if(argument == "--metric" && has_value) {
+            const std::string_view name{ argv[++index] };
+            if(name == "rgb") {
+                options.color_metric = color::metric::rgb;
+            } else if(name == "redmean") {
+                options.color_metric = color::metric::redmean;
+            } else if(name == "luma") {
+                options.color_metric = color::metric::luma;
+            } else if(name == "oklab") {
+                options.color_metric = color::metric::oklab;
+            } else if(name == "cie76") {
+                options.color_metric = color::metric::cie76;
+            } else if(name == "cie94") {
+                options.color_metric = color::metric::cie94;
+            } else {
+                return usage();
+            }
+        } else if(argument == "--linear-light") {
+            options.linear_light = true;
+        } else if(argument == "--palette" && has_value) {
+            const std::string_view name{ argv[++index] };
+            options.palette = palettes::find(name);
+            if(!options.palette) {
+                options.palette = palettes::load(name);
+                if(!options.palette) {
+                    return EXIT_FAILURE;
+                }
+            }
+        } else if(argument == "--crop" && has_value) {
+            std::array<std::size_t, 4> values{};
+            std::string_view text{ argv[++index] };
+            for(auto &value : values) {
+                const auto comma{ text.find(',') };
+                const auto number{ utils::parse_number<std::size_t>(text.substr(0, comma)) };
+                if(!number) {
+                    return usage();
+                }
+                value = *number;
+                text = comma == text.npos ? std::string_view{} : text.substr(comma + 1);
+            }
+            if(!text.empty()) {
+                return usage();
+            }
+            crop = region{ values[0], values[1], values[2], values[3] };
+        } else if((argument == "--rotate" || argument == "--flip") && has_value) {
+            const std::string_view value{ argv[++index] };
+            if(argument == "--rotate" && value == "90") {
+                options.output_orientation = orientation::rotate_90;
+            } else if(argument == "--rotate" && value == "180") {
+                options.output_orientation = orientation::rotate_180;
+            } else if(argument == "--rotate" && value == "270") {
+                options.output_orientation = orientation::rotate_270;
+            } else if(argument == "--flip" && value == "horizontal") {
+                options.output_orientation = orientation::flip_horizontal;
+            } else if(argument == "--flip" && value == "vertical") {
+                options.output_orientation = orientation::flip_vertical;
+            } else {
+                return usage();
+            }
+            orientation_option = argument;
+        } else if(argument == "--expand" && has_value) {
+            const std::string_view bits{ argv[++index] };
+            if(bits != "24" && bits != "32") {
+                return usage();
+            }
+            expand_bit_count = bits == "24" ? 24 : 32;
+        } else if(argument == "--remap") {
+            remap = true;
+        } else if(argument == "--pyramid" && has_value) {
+            const auto levels{ utils::parse_number<std::size_t>(argv[++index]) };
+            if(!levels || *levels == 0 || (std::size_t{ 1 } << *levels) > constants::max_strip_rows) {
+                return usage();
+            }
+            pyramid_levels = *levels;
+        } else if(argument == "--resize" && has_value) {
+            const std::string_view size{ argv[++index] };
+            const auto separator{ size.find('x') };
+            const auto width{ utils::parse_number<std::size_t>(size.substr(0, separator)) };
+            const auto height{ separator == size.npos ? std::nullopt : utils::parse_number<std::size_t>(size.substr(separator + 1)) };
+            if(!width || !height || (*width == 0 && *height == 0)) {
+                return usage();
+            }
+            resize.emplace(*width, *height);
+        } else if(argument == "--filter" && has_value) {
+            const std::string_view name{ argv[++index] };
+            if(name == "box") {
+                resize_filter = resample::filter::box;
+            } else if(name == "bilinear") {
+                resize_filter = resample::filter::bilinear;
+            } else if(name == "lanczos") {
+                resize_filter = resample::filter::lanczos;
+            } else {
+                return usage();
+            }
+        } else if(argument == "--variant" && index + 2 < argc) {
+            variant_specs.emplace_back(argv[index + 1], argv[index + 2]);
+            index += 2;
+        } else if(argument == "--full-lookup-table") {
+            options.full_lookup_table = true;
+        } else if(argument == "--lookup-table-cache" && has_value) {
+            options.lookup_table_cache = argv[++index];
+        } else if(argument == "--adaptive-palette") {
+            options.adaptive_palette = true;
+        } else if(argument == "--count-colors") {
+            count_colors_only = true;
+        } else if(argument == "--quantizer" && has_value) {
+            const std::string_view name{ argv[++index] };
+            if(name == "median-cut") {
+                options.palette_quantizer = quantizer::median_cut;
+            } else if(name == "octree") {
+                options.palette_quantizer = quantizer::octree;
+            } else {
+                return usage();
+            }
+            options.adaptive_palette = true;
+        } else if(argument == "--refine-palette" && has_value) {
+            const auto milliseconds{ utils::parse_number<std::uint32_t>(argv[++index]) };
+            if(!milliseconds) {
+                return usage();
+            }
+            options.refine_palette = true;
+            options.refinement.time_budget = std::chrono::milliseconds{ *milliseconds };
+        } else if(argument == "--palette-sample" && has_value) {
+            const auto percent{ utils::parse_number<double>(argv[++index]) };
+            if(!percent || !(*percent > 0 && *percent <= 100)) {
+                return usage();
+            }
+            options.palette_sample = *percent;
+        } else if(argument == "--shared-palette" && has_value) {
+            options.shared_palette = argv[++index];
+        } else if(argument == "--report-palette") {
+            options.report_palette = true;
+        } else if(argument == "--palette-seed" && has_value) {
+            const auto seed{ utils::parse_number<std::uint64_t>(argv[++index]) };
+            if(!seed) {
+                return usage();
+            }
+            options.refinement.seed = *seed;
+        } else if(argument == "--dither-tile" && has_value) {
+            auto map{ dither::load_threshold_map(argv[++index]) };
+            if(!map) {
+                return EXIT_FAILURE;
+            }
+            options.dithering_mode = dithering::ordered;
+            options.threshold_map = std::move(*map);
+        } else if(argument.starts_with("-") && argument != "-") {
+            return usage();
+        } else {
+            paths.emplace_back(argument);
+        }
+    }
+    if((options.palette_sample > 0 || options.report_palette) && !derives_palette(options)) {
+        std::cerr << "--palette-sample and --report-palette need --adaptive-palette or --refine-palette, without --palette\n";
+        return EXIT_FAILURE;
+    }
+    // Conversion modes other than the plain one run one at a time: combinations are rejected rather than all but
+    // one of them dropped.
+    const auto conflicting{ [](std::string_view first, std::string_view second) {
+        std::cerr << first << " cannot be combined with " << second << '\n';
+        return EXIT_FAILURE;
+    } };
+    using mode = std::pair<bool, std::string_view>;
+    // Modes that take over the whole run, in the order they are dispatched: any two of them conflict.
+    const std::array<mode, 8> exclusive_modes{ {
+        { count_colors_only, "--count-colors" },
+        { batch_output_directory.has_value(), "--batch" },
+        { expand_bit_count != 0, "--expand" },
+        { remap, "--remap" },
+        { pyramid_levels != 0, "--pyramid" },
+        { resize.has_value(), "--resize" },
+        { crop.has_value(), "--crop" },
+        { !variant_specs.empty(), "--variant" },
+    } };
+    if(const auto first{ std::ranges::find(exclusive_modes, true, &mode::first) }; first != exclusive_modes.end()) {
+        if(const auto second{ std::ranges::find(std::next(first), exclusive_modes.end(), true, &mode::first) };
+           second != exclusive_modes.end()) {
+            return conflicting(first->second, second->second);
+        }
+    }
+    // Orientation applies to plain and batch conversions only.
+    if(!orientation_option.empty()) {
+        const auto batch{ std::ranges::find(exclusive_modes, "--batch", &mode::second) };
+        for(auto other{ exclusive_modes.begin() }; other != exclusive_modes.end(); ++other) {
+            if(other->first && other != batch) {
+                return conflicting(orientation_option, other->second);
+            }
+        }
+    }
+    // Expanding decodes the color table of the input and remapping switches it to a fixed palette: neither derives one.
+    if(options.adaptive_palette && (expand_bit_count != 0 || remap)) {
+        return conflicting(expand_bit_count != 0 ? "--expand" : "--remap", "--adaptive-palette");
+    }
+    const auto report_memory{ [&options] {
+        if(const auto peak{ peak_resident_set_kib() }; options.report_memory && peak) {
+            std::cerr << "Peak resident set size: " << *peak << " KiB\n";
+        }
+    } };
+
+    // A lone input of "-" is converted from stdin to stdout.
+    if(!count_colors_only && !batch_output_directory && paths.size() == 1 && paths[0] == constants::standard_stream) {
+        paths.push_back(constants::standard_stream);
+    }
+    if(std::ranges::find(paths, constants::standard_stream) != paths.end()) {
+        std::ios::sync_with_stdio(false);
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+
+    // Count the colors of the inputs instead of converting them.
+    if(count_colors_only) {
+        if(paths.empty()) {
+            paths.push_back(constants::input_bmp_file_path);
+        }
+        bool counted{ true };
+        for(const auto &path : paths) {
+            const auto colors{ count_colors(path, options) };
+            if(colors) {
+                std::cout << path.string() << ": " << *colors << " colors\n";
+            }
+            counted = counted && colors;
+        }
+        report_memory();
+        return counted ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Convert a set of 24-bit BMPs to 4-bit.
+    if(batch_output_directory) {
+        const auto failures{ batch::convert(paths, *batch_output_directory, options) };
+        report_memory();
+        return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Convert input 24-bit BMP to 4-bit, and to every variant in the same pass.
+    const auto input_file_path{ paths.size() > 0 ? paths[0] : constants::input_bmp_file_path };
+    const auto output_file_path{ paths.size() > 1 ? paths[1] : constants::output_bmp_file_path };
+    if(expand_bit_count != 0) {
+        const auto expanded{ expand_bmp(input_file_path, output_file_path, expand_bit_count, options) };
+        report_memory();
+        return expanded ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if(remap) {
+        const auto remapped{ remap_bmp(input_file_path, output_file_path, options) };
+        report_memory();
+        return remapped ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if(pyramid_levels != 0) {
+        const auto converted{ convert_pyramid(input_file_path, output_file_path, pyramid_levels, options) };
+        report_memory();
+        return converted ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if(resize) {
+        const auto converted{ convert_resized(input_file_path, output_file_path, resize->first, resize->second,
+                                              resize_filter, options) };
+        report_memory();
+        return converted ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if(crop) {
+        const auto converted{ convert_region(input_file_path, output_file_path, *crop, options) };
+        report_memory();
+        return converted ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if(!variant_specs.empty()) {
+        std::vector<variant> variants{ { output_file_path, options } };
+        for(const auto &[spec, path] : variant_specs) {
+            auto &variant{ variants.emplace_back(path, options) };
+            const auto comma{ spec.find(',') };
+            const auto name{ spec.substr(0, comma) };
+            variant.settings.palette = palettes::find(name);
+            if(!variant.settings.palette) {
+                variant.settings.palette = palettes::load(name);
+            }
+            if(!variant.settings.palette || (comma != spec.npos && !set_dithering(spec.substr(comma + 1), variant.settings))) {
+                return usage();
+            }
+        }
+        const auto converted{ convert_variants(input_file_path, variants) };
+        report_memory();
+        return converted ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    const auto converted{ convert_bmp_24_to_4_depth(input_file_path, output_file_path, options) };
+    report_memory();
+    return converted ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -1,14 +1,18 @@
 /** @file bmp_file_tester.cpp
  *  @brief BMP file tester.
- *  @details This program tests an input BMP file and outputs its dimensions and number of bits per pixel (8 - 24 bits).
+ *  @details This program tests an input BMP file and outputs its dimensions and number of bits per pixel (8 - 24 bits),
+ *           and the number of distinct colors of 24-bit files.
  *  @author Baranov Konstantin (seigtm) <gh@seig.ru>
  *  @version 1.0
  *  @date 2024-02-18
  */
 
+#include <bit>
+#include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <vector>
 
 // Namespace with bmp related constants and file paths.
 namespace setm::bmp {
@@ -68,10 +72,10 @@ static const auto bmp_signature{ 0x4D42 };
 
 };  // namespace setm::bmp
 
-int main() {
+int main(int argc, char *argv[]) {
     using namespace setm::bmp;
 
-    std::ifstream input_bmp_file{ input_bmp_file_path, std::ios::binary };
+    std::ifstream input_bmp_file{ argc > 1 ? std::filesystem::path{ argv[1] } : input_bmp_file_path, std::ios::binary };
     if(!input_bmp_file) {
         std::cerr << "Failed to open input file\n";
         return EXIT_FAILURE;
@@ -95,4 +99,31 @@ int main() {
     //   BITMAPINFOHEADER::biBitCount (2B) - Number of bits per pixel (1, 4, 8, 16, 24, 32).
     std::cout << "Width: " << bmp_info_header.bi_width << " Height: " << bmp_info_header.bi_height
               << "\nNumber of bits per pixel: " << bmp_info_header.bi_bit_count << '\n';
+
+    // Count the distinct colors of a 24-bit image: one bit per color in a presence bitmap of 2^24 bits (2 MiB).
+    if(bmp_info_header.bi_bit_count != 24 || bmp_info_header.bi_compression != 0) {
+        return EXIT_SUCCESS;
+    }
+    const auto width{ static_cast<std::size_t>(std::abs(bmp_info_header.bi_width)) };
+    const auto height{ static_cast<std::size_t>(std::abs(bmp_info_header.bi_height)) };
+    std::vector<std::uint64_t> colors((1 << 24) / 64);
+    std::vector<rgb_triple> row(width);
+    input_bmp_file.seekg(bmp_file_header.bf_off_bits);
+    for(std::size_t y{}; y < height && input_bmp_file; ++y) {
+        input_bmp_file.read(reinterpret_cast<char *>(row.data()), width * sizeof(rgb_triple));
+        input_bmp_file.ignore((4 - width * sizeof(rgb_triple) % 4) % 4);
+        for(const auto &pixel : row) {
+            const auto key{ std::uint32_t{ pixel.red } << 16 | std::uint32_t{ pixel.green } << 8 | pixel.blue };
+            colors[key / 64] |= std::uint64_t{ 1 } << (key % 64);
+        }
+    }
+    if(!input_bmp_file) {
+        std::cerr << "Unexpected end of file\n";
+        return EXIT_FAILURE;
+    }
+    std::size_t distinct{};
+    for(const auto word : colors) {
+        distinct += std::popcount(word);
+    }
+    std::cout << "Number of distinct colors: " << distinct << '\n';
 }
@@ -0,0 +1,15 @@
+# Helpers sourced by the tests.
+
+# Writes the little-endian bytes of a 16- or 32-bit number.
+le16() { printf "$(printf '\\%03o\\%03o' $(($1 & 255)) $(($1 >> 8 & 255)))"; }
+le32() { le16 $(($1 & 65535)); le16 $(($1 >> 16 & 65535)); }
+
+# Writes a 24-bit BMP of random pixels: bmp <width> <height> <path>.
+bmp() {
+    row=$((($1 * 3 + 3) / 4 * 4))
+    {
+        printf 'BM'; le32 $((54 + row * $2)); le32 0; le32 54
+        le32 40; le32 "$1"; le32 "$2"; le16 1; le16 24; le32 0; le32 $((row * $2)); le32 2835; le32 2835; le32 0; le32 0
+        head -c $((row * $2)) /dev/urandom
+    } > "$3"
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Checks that every pair of conversion modes that cannot run together is refused, instead of one of them being
+# dropped: the run must fail with a "cannot be combined" message and write no output.
+# Usage: tests/conflicts.sh [path to bmp_converter]
+set -eu
+. "$(dirname "$0")/bmp.sh"
+
+converter=$(cd "$(dirname "${1:-./bmp_converter}")" && pwd)/$(basename "${1:-./bmp_converter}")
+directory=$(mktemp -d)
+trap 'rm -rf "$directory"' EXIT
+cd "$directory"
+bmp 16 16 input.bmp
+"$converter" input.bmp indexed.bmp
+mkdir batch
+
+status=0
+# Runs the converter with two modes and expects a refusal: refused <first mode> <second mode>.
+refused() {
+    rm -f output.bmp
+    # shellcheck disable=SC2086
+    if "$converter" $1 $2 indexed.bmp output.bmp 2>errors >/dev/null || ! grep -q "cannot be combined" errors ||
+       [ -e output.bmp ]; then
+        echo "not refused: $1 $2"
+        status=1
+    fi
+}
+
+# Modes that take over the whole run: no two of them combine.
+# Each is written with underscores for spaces.
+exclusive="--count-colors --batch_batch --expand_24 --remap --pyramid_2 --resize_8x8 --crop_0,0,4,4 --variant_cga_variant.bmp"
+for first in $exclusive; do
+    for second in $exclusive; do
+        if [ "$first" != "$second" ]; then
+            refused "$(echo "$first" | tr '_' ' ')" "$(echo "$second" | tr '_' ' ')"
+        fi
+    done
+    # Orientation combines with batch conversions only.
+    if [ "$first" != --batch_batch ]; then
+        refused "--rotate 90" "$(echo "$first" | tr '_' ' ')"
+        refused "--flip horizontal" "$(echo "$first" | tr '_' ' ')"
+    fi
+done
+for mode in "--expand 24" "--remap"; do
+    refused "$mode" "--adaptive-palette"
+    refused "--adaptive-palette" "$mode"
+done
+exit $status
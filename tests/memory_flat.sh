@@ -0,0 +1,36 @@
+#!/bin/sh
+# Checks that the peak memory of a conversion stays flat as the image grows: a 64 MP image may take no more than a
+# quarter of the memory budget over what a 4 MP one of the same width takes, in every mode that streams the pixels.
+# Usage: tests/memory_flat.sh [path to bmp_converter]
+set -eu
+. "$(dirname "$0")/bmp.sh"
+
+converter=${1:-./bmp_converter}
+budget=4
+directory=$(mktemp -d)
+trap 'rm -rf "$directory"' EXIT
+
+# Prints the peak resident set size in KiB of a conversion: peak <options>...
+peak() {
+    "$converter" --memory-budget "$budget" --report-memory "$@" 2>&1 >/dev/null |
+        sed -n 's/^Peak resident set size: \([0-9]*\) KiB$/\1/p'
+}
+
+bmp 8193 512 "$directory/small.bmp"
+bmp 8193 8191 "$directory/large.bmp"
+
+status=0
+for mode in "" "--dither floyd-steinberg" "--dither bayer8" "--adaptive-palette" "--count-colors"; do
+    # shellcheck disable=SC2086
+    small=$(peak $mode "$directory/small.bmp" "$directory/small_4bit.bmp")
+    # shellcheck disable=SC2086
+    large=$(peak $mode "$directory/large.bmp" "$directory/large_4bit.bmp")
+    if [ -z "$small" ] || [ -z "$large" ]; then
+        echo "${mode:-plain}: no peak reported"
+        status=1
+    elif [ "$large" -gt $((small + budget * 256)) ]; then
+        echo "${mode:-plain}: $small KiB at 4 MP, $large KiB at 64 MP"
+        status=1
+    fi
+done
+exit $status